@@ -13,224 +13,3530 @@
 // Declaration (would go to .h file once library is separated)
 // ===========================================================
 
+#include <iterator>
+
+// Size of the static arena all driver buffers are allocated from.
+// If 0, buffers are allocated from the heap, unless an arena is set with p44_ws2812::setArena()
+#ifndef P44_WS2812_ARENA_SIZE
+#define P44_WS2812_ARENA_SIZE 0
+#endif
+
+// Time in microseconds the data line may stay low before WS2812 chips reset (latch).
+// The datasheet says 50uS, which is also the minimum pause required after show()
+#ifndef P44_WS2812_RESET_MICROS
+#define P44_WS2812_RESET_MICROS 50
+#endif
+
+// Number of SPI bytes needed to encode one LED (8 SPI bits per WS2812 bit, 24 bits per LED)
+#define P44_WS2812_BYTES_PER_LED 24
+
+// DMA channel used for memory-to-memory copies of the pixel buffer (see p44_ws2812::enableDoubleBuffer())
+#if defined(STM32F10X_MD) && !defined(P44_WS2812_M2M_DMA)
+#define P44_WS2812_M2M_DMA DMA1_Channel7
+#define P44_WS2812_M2M_DMA_TCIF DMA_ISR_TCIF7
+#define P44_WS2812_M2M_DMA_CLEAR DMA_IFCR_CGIF7
+#endif
+
+// Precompiled installation configuration identification
+#define P44_WS2812_CONFIG_MAGIC 0x43343450 // "P44C"
+#define P44_WS2812_CONFIG_VERSION 1
+
+// Alignment of all driver buffers (4 = word aligned, suitable for 8,16 and 32 bit DMA transfers)
+#define P44_WS2812_BUFFER_ALIGN 4
+
+class p44_ws2812_renderer;
+
 class p44_ws2812 {
 
-  typedef struct {
-    unsigned int red:5;
-    unsigned int green:5;
-    unsigned int blue:5;
-  } __attribute((packed)) RGBPixel;
+public:
+
+  /// a run of LEDs in a layout, see setLayout()
+  typedef struct {
+    uint16_t start; // index of the first LED of the run in the chain
+    int16_t stride; // index increment from one LED of the run to the next (1 = forward, -1 = backward)
+    uint16_t length; // number of LEDs in the run
+  } LayoutRun;
+
+  /// header of a precompiled installation configuration, see useConfig()
+  /// All multi-byte values are little endian, offsets are relative to the start of the header.
+  typedef struct {
+    uint32_t magic; // P44_WS2812_CONFIG_MAGIC
+    uint16_t version; // P44_WS2812_CONFIG_VERSION
+    uint16_t numLeds; // number of LEDs the configuration is for
+    uint16_t ledsPerRow; // number of LEDs per row
+    uint8_t flags; // bit 0: X reversed, bit 1: alternating
+    uint8_t calibrationBits; // 0 = no calibration table, 4 or 8 bits per factor
+    uint16_t numRuns; // number of LayoutRun entries, 0 for regular layout
+    uint16_t reserved;
+    uint32_t runsOffset; // offset of the LayoutRun array (2-byte aligned)
+    uint32_t calibrationOffset; // offset of the calibration table
+  } ConfigHeader;
+
+  /// frame timing statistics, see enableFrameStats()
+  static const uint8_t jitterBuckets = 8;
+  typedef struct {
+    uint32_t targetInterval; // expected interval between show() calls in microseconds
+    uint32_t lastShow; // micros() of last show()
+    uint32_t frames; // number of intervals measured
+    uint32_t minInterval; // shortest interval seen
+    uint32_t maxInterval; // longest interval seen
+    uint32_t jitter[jitterBuckets]; // histogram of deviation from target: <16uS, <32uS, <64uS ... <1024uS, >=1024uS
+  } FrameStats;
+
+private:
+
+  typedef struct {
+    unsigned int red:5;
+    unsigned int green:5;
+    unsigned int blue:5;
+  } __attribute((packed)) RGBPixel;
+
+  typedef struct {
+    uint32_t dutySum; // sum of the PWM duty (0..255) of all channels of all LEDs in the region
+    uint16_t heat; // moving average of the mean duty per channel, 8.8 fixed point
+    uint8_t derating; // brightness factor applied when encoding, 255 = none
+    uint8_t reserved;
+  } ThermalRegion;
+
+  uint16_t numLeds; // number of LEDs
+  RGBPixel *pixelBufferP; // the pixel buffer
+  uint8_t *encodeBufferP; // (chain only) persistent SPI encoded representation of the pixel buffer, NULL if encoding on the fly
+  RGBPixel *snapshotBufferP; // (chain only) copy of the pixel buffer show() transfers from, NULL if not double buffered
+  uint16_t snapshotDirtyEnd; // (chain only) dirtyEnd at the time the snapshot was taken
+  bool snapshotTaken; // (chain only) set when a snapshot was taken since the last show()
+  bool snapshotCopying; // (chain only) set while the snapshot is being copied in the background
+  FrameStats *frameStatsP; // (chain only) frame timing statistics, NULL if not enabled
+  bool skipUnchanged; // (chain only) if set, show() does not transfer frames identical to the last one transferred
+  bool fingerprintValid; // (chain only) set if lastFingerprint represents the state of the LEDs
+  uint32_t lastFingerprint; // (chain only) fingerprint of the last frame transferred
+  uint16_t ledsPerRow; // number of LEDs per row
+  bool xReversed; // even (0,2,4...) rows go backwards, or all if not alternating
+  bool alternating; // direction changes after every row
+  const LayoutRun *layoutRunsP; // run length compressed layout, NULL if layout is defined by ledsPerRow/xReversed/alternating
+  uint16_t numLayoutRuns; // number of runs in the layout
+  uint16_t cachedRun; // run last used for mapping
+  uint16_t cachedRunStart; // LED number of the first LED in cachedRun
+  uint16_t *blurScratchP; // scratch buffer for blur(), 3 channels of blurScratchLen values each
+  uint16_t blurScratchLen; // length of the longest row or column blurScratchP can hold
+  p44_ws2812 *chainP; // the chain this is a segment of, NULL if this object is the chain itself
+  uint16_t firstLed; // index of first LED of this segment within the chain
+  byte corrRed; // color correction factors, 255 = no correction
+  byte corrGreen;
+  byte corrBlue;
+  uint16_t dirtyEnd; // (chain only) number of LEDs from the beginning of the chain that need to be transferred by next show()
+  const uint8_t *calibrationP; // (chain only) per-LED brightness calibration factors, NULL if none
+  uint8_t calibrationBits; // (chain only) 8 or 4 bits per calibration factor
+  uint8_t irqPriorityThreshold; // (chain only) IRQs with this or lower priority are blocked during show(), 0 = block all
+  ThermalRegion *thermalP; // (chain only) thermal model regions, NULL if not enabled
+  uint8_t thermalShift; // (chain only) regions are 2^thermalShift LEDs
+  uint8_t thermalLimit; // (chain only) maximal long term mean duty per channel in a region
+  uint8_t thermalTau; // (chain only) heat follows duty with a time constant of 2^thermalTau frames
+  p44_ws2812_renderer *rendererP; // renderer of the progressive frame in progress or waiting for commit, NULL if none
+  bool renderDone; // set when the progressive frame is complete, but not yet committed
+  uint8_t renderCommit; // value of the chain's renderCommits when the progressive frame was completed
+  uint8_t rendersInProgress; // (chain only) number of progressive frames in progress in the chain and its segments
+  uint8_t renderCommits; // (chain only) incremented whenever progressive frames are committed
+
+  static uint8_t *arenaP; // arena buffers are allocated from, NULL if heap is used
+  static size_t arenaSize; // size of the arena
+  static size_t arenaUsed; // bytes used in the arena so far
+  static size_t ramUsed; // total bytes of buffers allocated by all driver instances
+
+public:
+
+  /// a color
+  typedef struct {
+    byte red; // intensity of red component, 0..255
+    byte green; // intensity of green component, 0..255
+    byte blue; // intensity of blue component, 0..255
+  } RGBColor;
+
+  /// proxy reference to the color of a LED in the pixel buffer, as returned by dereferencing an iterator
+  class PixelRef {
+    p44_ws2812 *leds;
+    uint16_t ledIndex;
+  public:
+    PixelRef(p44_ws2812 *aLeds, uint16_t aLedIndex) : leds(aLeds), ledIndex(aLedIndex) {};
+    operator RGBColor() const { RGBColor c = { 0, 0, 0 }; leds->getPixel(ledIndex, c); return c; };
+    PixelRef &operator=(const RGBColor &aColor) { leds->setPixel(ledIndex, aColor); return *this; };
+    PixelRef &operator=(const PixelRef &aOther) { return *this = (RGBColor)aOther; };
+    friend void swap(PixelRef aA, PixelRef aB) { RGBColor c = aA; aA = (RGBColor)aB; aB = c; };
+  };
+
+  /// random access iterator over LEDs in the pixel buffer, for use with standard algorithms
+  /// @note the iterator moves through the buffer with a fixed stride, so it also covers rows running backwards
+  class iterator {
+    p44_ws2812 *leds;
+    int32_t ledIndex;
+    int16_t stride;
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef RGBColor value_type;
+    typedef int32_t difference_type;
+    typedef PixelRef reference;
+    typedef PixelRef *pointer;
+    iterator() : leds(NULL), ledIndex(0), stride(1) {};
+    iterator(p44_ws2812 *aLeds, int32_t aLedIndex, int16_t aStride) : leds(aLeds), ledIndex(aLedIndex), stride(aStride) {};
+    PixelRef operator*() const { return PixelRef(leds, ledIndex); };
+    PixelRef operator[](difference_type aN) const { return PixelRef(leds, ledIndex+aN*stride); };
+    iterator &operator++() { ledIndex += stride; return *this; };
+    iterator operator++(int) { iterator i = *this; ledIndex += stride; return i; };
+    iterator &operator--() { ledIndex -= stride; return *this; };
+    iterator operator--(int) { iterator i = *this; ledIndex -= stride; return i; };
+    iterator &operator+=(difference_type aN) { ledIndex += aN*stride; return *this; };
+    iterator &operator-=(difference_type aN) { ledIndex -= aN*stride; return *this; };
+    iterator operator+(difference_type aN) const { return iterator(leds, ledIndex+aN*stride, stride); };
+    iterator operator-(difference_type aN) const { return iterator(leds, ledIndex-aN*stride, stride); };
+    difference_type operator-(const iterator &aOther) const { return (ledIndex-aOther.ledIndex)/stride; };
+    bool operator==(const iterator &aOther) const { return ledIndex==aOther.ledIndex; };
+    bool operator!=(const iterator &aOther) const { return ledIndex!=aOther.ledIndex; };
+    bool operator<(const iterator &aOther) const { return (aOther-*this)>0; };
+    bool operator>(const iterator &aOther) const { return (*this-aOther)>0; };
+    bool operator<=(const iterator &aOther) const { return !(*this>aOther); };
+    bool operator>=(const iterator &aOther) const { return !(*this<aOther); };
+  };
+
+  /// a range of LEDs, for use with range based for loops and standard algorithms
+  class Range {
+    iterator first;
+    iterator last;
+  public:
+    Range(const iterator &aBegin, const iterator &aEnd) : first(aBegin), last(aEnd) {};
+    iterator begin() const { return first; };
+    iterator end() const { return last; };
+    int32_t size() const { return last-first; };
+  };
+
+  /// a single pixel update for applyUpdates()
+  typedef struct {
+    uint16_t ledNumber; // LED number as used with setColor()
+    byte red; // intensity of red component, 0..255
+    byte green; // intensity of green component, 0..255
+    byte blue; // intensity of blue component, 0..255
+  } Update;
+
+  /// create driver for a WS2812 LED chain
+  /// @param aNumLeds number of LEDs in the chain
+  /// @param aLedsPerRow number of LEDs in a row (x size in a X/Y arrangement of the LEDs)
+  /// @param aXReversed X direction is reversed
+  /// @param aAlternating X direction is reversed in first row, normal in second, reversed in third etc..
+  p44_ws2812(uint16_t aNumLeds, uint16_t aLedsPerRow=0, bool aXReversed=false, bool aAlternating=false);
+
+  /// create a segment (logical sub-strip) of an existing WS2812 LED chain
+  /// @param aChain the chain (or another segment of it) this segment is a part of
+  /// @param aFirstLed index of the first LED of this segment within aChain
+  /// @param aNumLeds number of LEDs in the segment (will be truncated to what is available in aChain)
+  /// @param aLedsPerRow number of LEDs in a row (x size in a X/Y arrangement of the LEDs)
+  /// @param aXReversed X direction is reversed
+  /// @param aAlternating X direction is reversed in first row, normal in second, reversed in third etc..
+  /// @note the segment has no buffer of its own, it directly operates on its range of the chain's pixel buffer.
+  ///   Calling show() on a segment transfers the entire chain. The chain object must outlive its segments.
+  p44_ws2812(p44_ws2812 &aChain, uint16_t aFirstLed, uint16_t aNumLeds, uint16_t aLedsPerRow=0, bool aXReversed=false, bool aAlternating=false);
+
+  /// destructor
+  ~p44_ws2812();
+
+  /// begin using the driver
+  void begin();
+
+  /// transfer RGB values to LED chain
+  /// @note this must be called to update the actual LEDs after modifying RGB values
+  /// with setColor() and/or setColorDimmed()
+  /// @note only the LEDs up to the highest one modified since the last show() are transferred,
+  ///   the LEDs further down the chain just keep their current state.
+  void show();
+
+  /// make next show() transfer the entire chain, even if no LEDs were modified
+  void invalidate();
+
+  /// collect statistics about the timing of show() calls
+  /// @param aTargetIntervalMicros the intended interval between show() calls, jitter is measured against it
+  /// @return false if statistics could not be allocated
+  bool enableFrameStats(uint32_t aTargetIntervalMicros);
+
+  /// @return frame timing statistics, NULL if not enabled
+  const FrameStats *getFrameStats();
+
+  /// reset frame timing statistics
+  void resetFrameStats();
+
+  /// print frame interval and jitter histogram
+  /// @param aOut where to print to, e.g. Serial
+  void printFrameStats(Print &aOut);
+
+  /// calculate a fingerprint (CRC32) of the chain's current pixel buffer
+  /// @param aUseHardware if set, the STM32 CRC unit is used when available
+  /// @return the fingerprint. Hardware and software calculation yield identical results
+  ///   (polynomial 0x04C11DB7, initial value 0xFFFFFFFF, 32 bit words, no reflection, no final XOR)
+  uint32_t getFingerprint(bool aUseHardware=true);
+
+  /// skip transferring frames that did not change since the last transfer
+  /// @param aSkipUnchanged if set, show() compares the fingerprint of the frame to the last one transferred
+  ///   and does not transfer anything if they match
+  void setSkipUnchanged(bool aSkipUnchanged);
+
+  /// model heating of LED regions and derate the brightness of regions that run too hot for too long
+  /// @param aRegionShift regions are 2^aRegionShift consecutive LEDs of the chain (e.g. 5 for rows of 32 LEDs)
+  /// @param aLimit maximal long term mean PWM duty per channel in a region, 0..255
+  /// @param aTimeConstantShift heat follows duty with a time constant of 2^aTimeConstantShift frames
+  /// @return false if the region table could not be allocated
+  /// @note the duty per region is maintained whenever a LED is modified, so updating the model in show()
+  ///   only costs O(regions). Derating is applied when encoding (on top of calibration).
+  /// @note the duty follows the pixel buffer, not the frame being transferred. With double buffering,
+  ///   it may already include changes for the next frame, so the model can lead the LEDs by one frame.
+  ///   As heat changes over many frames, this does not affect derating noticeably.
+  bool enableThermalModel(uint8_t aRegionShift, uint8_t aLimit, uint8_t aTimeConstantShift=8);
+
+  /// @return brightness factor currently applied to a region by the thermal model, 255 = none
+  uint8_t getDerating(uint16_t aRegion);
+
+  /// @return modelled heat of a region as mean PWM duty per channel, 0..255
+  uint8_t getHeat(uint16_t aRegion);
+
+  /// use double buffering, i.e. show() transfers a snapshot of the pixel buffer
+  /// @return false if the snapshot buffer could not be allocated, or an encode buffer is in use
+  /// @note snapshots are copied by DMA in the background. This allows preparing the next frame while
+  ///   the snapshot is being taken and transferred. Modifying the pixel buffer waits for a running copy
+  ///   to complete first, so there is no tearing.
+  bool enableDoubleBuffer();
+
+  /// start taking a snapshot of the pixel buffer for the next show()
+  /// @note if no snapshot is taken before show(), show() takes one itself (except while progressive frames
+  ///   are being rendered, see renderProgressive())
+  void snapshot();
+
+  /// render a frame progressively, in chunks spread over several calls
+  /// @param aRenderer the renderer. If no frame is in progress, a new frame is started with aRenderer.
+  ///   If a frame of another renderer is in progress, it is cancelled first (see cancelProgressive()).
+  /// @param aBudgetMicros time available for rendering in this call. Chunks are rendered until the frame
+  ///   is complete or the budget is exhausted (the last chunk may exceed the budget).
+  /// @return true when the frame was completed in this call
+  /// @note requires double buffering (see enableDoubleBuffer()): while frames are in progress, show() keeps
+  ///   transferring the last committed frame. Frames are committed with snapshot() when no progressive frame
+  ///   of the chain or any of its segments is in progress any more. Until then, completed frames wait, i.e.
+  ///   no new frame is started. Without double buffering, frames are rendered completely, regardless of aBudgetMicros.
+  bool renderProgressive(p44_ws2812_renderer &aRenderer, uint32_t aBudgetMicros);
+
+  /// cancel the progressive frame of this chain or segment, if any
+  /// @note the LEDs rendered so far remain in the pixel buffer. If this was the last progressive frame in
+  ///   progress, the frames of the chain and its segments are committed, as if it had been completed.
+  void cancelProgressive();
+
+  /// set per-LED brightness calibration, applied when LEDs are encoded for transfer
+  /// @param aCalibrationP calibration table (usually a const array in flash) for the entire chain, NULL for none.
+  ///   With 8 bits, the table contains 3 bytes per LED (red, green, blue) with factor (n+1)/256.
+  ///   With 4 bits, the table contains 2 bytes per LED (red<<4 | green, blue<<4) with factor (136+n*8)/256,
+  ///   i.e. 53% to 100% in steps of 3%.
+  /// @param aBits 8 or 4 bits per factor
+  /// @note calibration is applied to the PWM duty cycle and does not affect the resolution of the pixel buffer.
+  void setCalibration(const uint8_t *aCalibrationP, uint8_t aBits=8);
+
+  /// keep a persistent SPI encoded copy of the pixel buffer
+  /// @return false if the encode buffer could not be allocated (show() will continue to encode on the fly)
+  /// @note with the encode buffer, LEDs are encoded when their color is set, so show() only needs
+  ///   to transfer the data. This needs P44_WS2812_BYTES_PER_LED additional bytes of RAM per LED,
+  ///   but makes CPU cost proportional to the number of changed LEDs rather than the chain length.
+  bool enableEncodeBuffer();
+
+  /// set which IRQs are blocked while show() transfers data
+  /// @param aPriority 0 to block all IRQs (default). Otherwise, only IRQs with priority aPriority or lower
+  ///   (numerically >= aPriority, as set with NVIC_SetPriority()) are blocked, while higher priority IRQs
+  ///   continue to be served. These must be shorter than getMaxIrqNanos() to not reset the LED chain.
+  ///   Values beyond the lowest priority (1<<__NVIC_PRIO_BITS)-1 are clamped to it.
+  void setIrqPriorityThreshold(uint8_t aPriority);
+
+  /// @return maximum duration of an IRQ (including entry and exit) in nanoseconds that can interrupt show()
+  ///   without causing WS2812 chips to reset in midst of data stream
+  static uint32_t getMaxIrqNanos();
+
+  /// set color of one LED
+  /// @param aRed intensity of red component, 0..255
+  /// @param aGreen intensity of green component, 0..255
+  /// @param aBlue intensity of blue component, 0..255
+  void setColorXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue);
+  void setColor(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue);
+
+  /// set color of one LED, scaled by a visible brightness (non-linear) factor
+  /// @param aRed intensity of red component, 0..255
+  /// @param aGreen intensity of green component, 0..255
+  /// @param aBlue intensity of blue component, 0..255
+  /// @param aBrightness brightness, will be converted non-linear to PWM duty cycle for uniform brightness scale, 0..255
+  void setColorDimmedXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue, byte aBrightness);
+  void setColorDimmed(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aBrightness);
+
+  /// get current color of LED
+  /// @param aRed set to intensity of red component, 0..255
+  /// @param aGreen set to intensity of green component, 0..255
+  /// @param aBlue set to intensity of blue component, 0..255
+  /// @note for LEDs set with setColorDimmed(), this returns the scaled down RGB values,
+  ///   not the original r,g,b parameters. Note also that internal brightness resolution is 5 bits only.
+  void getColorXY(uint16_t aX, uint16_t aY, byte &aRed, byte &aGreen, byte &aBlue);
+
+  /// get color of a LED as actually transferred, decoded from its SPI encoding
+  /// @param aX,aY position of the LED
+  /// @param aColor set to the PWM duty cycles (linear, 0..255) including gamma, calibration and thermal derating
+  /// @return false if there is no LED at this position
+  /// @note with double buffering, this is the color in the last snapshot taken
+  bool getOutputColorXY(uint16_t aX, uint16_t aY, RGBColor &aColor);
+  void getColor(uint16_t aLedNumber, byte &aRed, byte &aGreen, byte &aBlue);
+
+  /// set colors of a batch of (usually scattered) LEDs
+  /// @param aUpdatesP array of updates
+  /// @param aNumUpdates number of updates in the array
+  /// @note updates are applied in LED number order, with mapping computed incrementally.
+  ///   When the same LED appears more than once, the last update in the array wins.
+  void applyUpdates(const Update *aUpdatesP, uint16_t aNumUpdates);
+
+  /// set color correction for this chain or segment
+  /// @param aRed scaling factor for red component, 0..255 (255 = no correction)
+  /// @param aGreen scaling factor for green component, 0..255 (255 = no correction)
+  /// @param aBlue scaling factor for blue component, 0..255 (255 = no correction)
+  /// @note correction is applied when colors are set, so getColor() returns corrected values
+  void setColorCorrection(byte aRed, byte aGreen, byte aBlue);
+
+  /// set a run length compressed layout for irregular arrangements of the LEDs
+  /// @param aRunsP array of runs (usually a const array in flash), consecutive LED numbers (as used with setColor(),
+  ///   or y*ledsPerRow+x with setColorXY()) are mapped to the runs in order. NULL to use the regular
+  ///   layout defined by the constructor's aLedsPerRow/aXReversed/aAlternating again.
+  /// @param aNumRuns number of runs
+  /// @note mapping is fastest for increasing LED numbers, as the last run used is cached.
+  ///   Parts of runs outside the chain are ignored.
+  void setLayout(const LayoutRun *aRunsP, uint16_t aNumRuns);
+
+  /// compile a layout from a table of LED indices
+  /// @param aIndexTableP table containing the index in the chain for each LED number
+  /// @param aNumEntries number of entries in the table
+  /// @param aRunsP where to store the runs
+  /// @param aMaxRuns size of aRunsP
+  /// @return number of runs generated, 0 if aMaxRuns was not sufficient
+  /// @note this does not depend on the hardware and can be used in host tools to generate layouts
+  static uint16_t compileLayout(const uint16_t *aIndexTableP, uint16_t aNumEntries, LayoutRun *aRunsP, uint16_t aMaxRuns);
+
+  /// use a precompiled installation configuration in place
+  /// @param aConfigP the configuration (usually a const array in flash, or a memory mapped file), must be
+  ///   4-byte aligned and remain valid as long as the driver uses it. Nothing is copied or parsed per LED.
+  /// @param aConfigSize size of the configuration in bytes
+  /// @return false if the configuration is invalid or does not match this chain, including runs reaching
+  ///   outside of it (nothing is changed then)
+  /// @note configurations with calibration tables can only be used on a chain, not on a segment
+  bool useConfig(const uint8_t *aConfigP, size_t aConfigSize);
+
+  /// build a precompiled installation configuration
+  /// @param aBufferP where to store the configuration (4-byte aligned)
+  /// @param aBufferSize size of the buffer
+  /// @param aNumLeds,aLedsPerRow,aXReversed,aAlternating layout, as for the constructor
+  /// @param aRunsP layout runs (see setLayout()), NULL for regular layout
+  /// @param aNumRuns number of layout runs
+  /// @param aCalibrationP calibration table (see setCalibration()), NULL for none
+  /// @param aCalibrationBits 4 or 8
+  /// @return size of the configuration, 0 if aBufferSize was not sufficient
+  /// @note this does not depend on the hardware and can be used in host tools to generate configurations
+  static size_t buildConfig(
+    uint8_t *aBufferP, size_t aBufferSize,
+    uint16_t aNumLeds, uint16_t aLedsPerRow, bool aXReversed, bool aAlternating,
+    const LayoutRun *aRunsP, uint16_t aNumRuns,
+    const uint8_t *aCalibrationP, uint8_t aCalibrationBits
+  );
+
+  /// fill a range of LEDs with a linear gradient between color stops
+  /// @param aFirstLed first LED number
+  /// @param aNumLeds number of LEDs
+  /// @param aColorsP color stops, evenly distributed from first to last LED
+  /// @param aNumColors number of color stops
+  /// @note colors are stepped with fixed point increments, i.e. without any divisions per LED
+  void fillGradient(uint16_t aFirstLed, uint16_t aNumLeds, const RGBColor *aColorsP, uint8_t aNumColors);
+  void fillGradient(uint16_t aFirstLed, uint16_t aNumLeds, const RGBColor &aStart, const RGBColor &aEnd);
+
+  /// fill a range of LEDs with colors interpolated from a palette
+  /// @param aPaletteP palette of 16 colors
+  /// @param aOffset palette position of the first LED, 0..65535 covers the entire palette (wrapping around to the first color)
+  /// @param aStride palette position increment per LED
+  /// @param aFirstLed first LED number
+  /// @param aNumLeds number of LEDs
+  void fillPalette(const RGBColor *aPaletteP, uint16_t aOffset, uint16_t aStride, uint16_t aFirstLed=0, uint16_t aNumLeds=0xFFFF);
+
+  /// maximal radius for blur()
+  static const uint8_t maxBlurRadius = 15;
+
+  /// blur LEDs with a box filter, rows and columns separately
+  /// @param aRadius radius of the filter, 1..maxBlurRadius
+  /// @param aPasses number of passes, 3 passes approximate a gaussian blur
+  /// @return false if the scratch buffer could not be allocated
+  /// @note runtime is independent of the radius. Rows and columns follow the layout, and are processed in a
+  ///   scratch buffer with 12 bit precision, which needs 6 bytes per LED of the longest row or column.
+  bool blur(uint8_t aRadius, uint8_t aPasses=1);
+
+  /// @name RLE sprites
+  /// Sprite format: width, height, number of palette colors n (0 = no palette), n*3 bytes palette (R,G,B),
+  /// followed by the rows. Each row is a sequence of runs exactly covering the width. A run starts with
+  /// a control byte, type<<6 | (length-1) for 1..64 pixels:
+  /// - type 0: transparent, no data
+  /// - type 1: solid, followed by one color
+  /// - type 2: literal, followed by length colors
+  /// Colors are a palette index byte, or 3 bytes R,G,B when the sprite has no palette.
+  /// Atlas format: number of sprites, followed by a 16 bit (little endian) offset from the atlas start per sprite.
+  /// @{
+
+  /// draw a sprite, transparent runs are skipped without touching the pixel buffer
+  /// @param aSpriteP the sprite (usually a const array in flash)
+  /// @param aX,aY position of the sprite's top left pixel, sprites are clipped at the edges
+  void blit(const uint8_t *aSpriteP, int16_t aX, int16_t aY);
+
+  /// @return sprite aSpriteNo from an atlas, NULL if there is no such sprite
+  static const uint8_t *getSprite(const uint8_t *aAtlasP, uint8_t aSpriteNo);
+
+  /// compress a sprite
+  /// @param aBufferP where to store the sprite
+  /// @param aBufferSize size of the buffer
+  /// @param aPixelsP aWidth*aHeight pixels, row by row
+  /// @param aWidth,aHeight size of the sprite, 1..255
+  /// @param aTransparentP pixels of this color are transparent, NULL for none
+  /// @param aPaletteP palette, NULL to store RGB colors. All non-transparent pixels must be in the palette.
+  /// @param aNumColors number of colors in aPaletteP, 1..255
+  /// @return size of the compressed sprite, 0 if aBufferSize was not sufficient or a color is not in the palette
+  /// @note this does not depend on the hardware and can be used in host tools to generate sprites
+  static size_t compressSprite(
+    uint8_t *aBufferP, size_t aBufferSize,
+    const RGBColor *aPixelsP, uint8_t aWidth, uint8_t aHeight,
+    const RGBColor *aTransparentP, const RGBColor *aPaletteP, uint8_t aNumColors
+  );
+
+  /// build a sprite atlas
+  /// @param aBufferP where to store the atlas
+  /// @param aBufferSize size of the buffer
+  /// @param aSpritesP the compressed sprites
+  /// @param aSizesP size of each sprite
+  /// @param aNumSprites number of sprites
+  /// @return size of the atlas, 0 if aBufferSize was not sufficient or the atlas would exceed 64k
+  static size_t buildAtlas(uint8_t *aBufferP, size_t aBufferSize, const uint8_t * const *aSpritesP, const size_t *aSizesP, uint8_t aNumSprites);
+
+  /// @}
+
+  /// set a range of LEDs to the same color
+  /// @param aFirstLed first LED number
+  /// @param aNumLeds number of LEDs
+  /// @param aRed intensity of red component, 0..255
+  /// @param aGreen intensity of green component, 0..255
+  /// @param aBlue intensity of blue component, 0..255
+  void fill(uint16_t aFirstLed, uint16_t aNumLeds, byte aRed, byte aGreen, byte aBlue);
+
+  /// get color of a LED by its index in the pixel buffer, bypassing the layout
+  /// @param aLedIndex index in the pixel buffer (in a segment: relative to the segment's first LED)
+  /// @param aColor set to the LED's color
+  void getPixel(uint16_t aLedIndex, RGBColor &aColor);
+
+  /// set color of a LED by its index in the pixel buffer, bypassing the layout and color correction
+  /// @param aLedIndex index in the pixel buffer (in a segment: relative to the segment's first LED)
+  /// @param aColor the new color
+  void setPixel(uint16_t aLedIndex, const RGBColor &aColor);
+
+  /// apply a pixel pipeline (see p44_ws2812_stage) to all LEDs in a single pass
+  /// @param aPipeline a single stage, or several stages combined with operator|
+  template<class P> void process(const P &aPipeline);
+
+  /// transfer RGB values to LED chain with a pixel pipeline applied on the fly
+  /// @param aPipeline a single stage, or several stages combined with operator|
+  /// @return false if nothing was transferred because the pipeline remaps LEDs while a run layout is set
+  /// @note the pixel buffer is not modified, and the entire chain is transferred.
+  /// @note the transfer runs with interrupts blocked, so remapping pipelines are limited to matrix layouts,
+  ///   where the LED number of each LED is cheap to calculate. Use process() and show() with run layouts.
+  template<class P> bool showProcessed(const P &aPipeline);
+
+  /// @return range of all LEDs in pixel buffer order
+  Range pixels() { return Range(iterator(this, 0, 1), iterator(this, numLeds, 1)); };
+
+  /// get a range of LEDs in pixel buffer order
+  /// @param aFirstLedIndex index of the first LED in the pixel buffer
+  /// @param aNumLeds number of LEDs
+  Range segment(uint16_t aFirstLedIndex, uint16_t aNumLeds);
+
+  /// get a row of LEDs, in X order
+  /// @param aY the row
+  /// @note the range starts at the first X position actually present in the pixel buffer (last row of a
+  ///   chain might be incomplete), and with layouts set by setLayout() it ends where that run ends
+  Range row(uint16_t aY);
+
+  /// get a span of LEDs, i.e. the maximal range of LED numbers starting at aLedNumber that is
+  /// equally spaced in the pixel buffer
+  /// @param aLedNumber the first LED number
+  Range span(uint16_t aLedNumber);
+
+  /// @return number of LEDs
+  int getNumLeds();
+
+  /// @return number of LEDs show() transfers, i.e. of the entire chain (for segments, too)
+  int getChainNumLeds();
+
+  /// @return number of LEDs per row
+  int getLedsPerRow();
+
+  /// set a caller supplied static arena to allocate all driver buffers from
+  /// @param aArenaP the arena memory, must be aligned to P44_WS2812_BUFFER_ALIGN
+  /// @param aArenaSize the size of the arena in bytes, which is the budget for all driver buffers together
+  /// @return false if the arena could not be set because driver buffers have already been allocated,
+  ///   or because aArenaP is not aligned
+  /// @note as driver instances are usually global objects, this must be called before they are constructed, for example
+  ///   from the constructor of a global object defined earlier. Alternatively, define P44_WS2812_ARENA_SIZE.
+  static bool setArena(void *aArenaP, size_t aArenaSize);
+
+  /// @return total number of bytes of RAM used by buffers of all driver instances
+  static size_t getRamUsage();
+
+  /// @return number of bytes still available in the arena, or 0 if buffers are allocated from the heap
+  static size_t getArenaFree();
+
+private:
+
+  /// allocate a zeroed, aligned driver buffer from the arena or the heap
+  /// @param aSize size of the buffer in bytes
+  /// @return pointer to the buffer, NULL if not enough memory
+  static void *allocBuffer(size_t aSize);
+
+  /// free a buffer allocated with allocBuffer()
+  /// @param aBufferP the buffer
+  /// @param aSize the same size as passed to allocBuffer()
+  /// @note buffers from the arena are only released when they are the most recent allocation
+  static void freeBuffer(void *aBufferP, size_t aSize);
+
+  uint16_t ledIndexFromXY(uint16_t aX, uint16_t aY);
+
+  /// @return LED number for an index in the pixel buffer, 0xFFFF if not mapped
+  uint16_t ledNumberFromIndex(uint16_t aLedIndex);
+
+  /// @return index in the pixel buffer for a LED number via the layout runs, 0xFFFF if not mapped
+  uint16_t ledIndexFromRuns(uint16_t aLedNumber);
+
+  /// get a span of consecutive LED numbers that map to equally spaced LEDs in the pixel buffer
+  /// @param aLedNumber the first LED number of the span
+  /// @param aLedIndex set to the index in the pixel buffer of aLedNumber, or 0xFFFF if the span is not mapped to any LEDs
+  /// @param aStride set to the index increment within the span
+  /// @return number of LEDs in the span, 0 if aLedNumber is beyond the layout
+  uint16_t getSpan(uint16_t aLedNumber, uint16_t &aLedIndex, int16_t &aStride);
+
+  /// store colors from a generator into a range of LEDs, span by span
+  /// @param aGenerator object with next(RGBColor &) returning the next color, and skip(uint16_t) skipping colors
+  template<class G> void generate(uint16_t aFirstLed, uint16_t aNumLeds, G &aGenerator);
+
+  /// blur a row or column
+  void blurLine(bool aColumn, uint16_t aLine, uint16_t aLength, uint8_t aRadius, uint8_t aPasses);
+
+  /// @return true if row aY runs backwards
+  inline bool rowReversed(uint16_t aY) { return alternating && (aY & 0x1) ? !xReversed : xReversed; };
+
+  /// store color into the pixel buffer, apply color correction and track modification
+  /// @param aLedIndex index into the pixel buffer, must be < numLeds
+  void storeColor(uint16_t aLedIndex, byte aRed, byte aGreen, byte aBlue);
+
+  /// store color into the pixel buffer as-is (for colors read back from the buffer) and track modification
+  /// @param aLedIndex index into the pixel buffer, must be < numLeds
+  void storePixel(uint16_t aLedIndex, byte aRed, byte aGreen, byte aBlue);
+
+  /// update thermal model, called once per frame
+  void updateThermalModel();
+
+  /// mark LED as modified, such that next show() will transfer it, and re-encode it when using an encode buffer
+  /// @param aLedIndex index into the pixel buffer
+  void markDirty(uint16_t aLedIndex);
+
+  /// encode a LED into SPI bytes
+  /// @param aLedIndex index into the chain's pixel buffer
+  /// @param aOutP where to store P44_WS2812_BYTES_PER_LED bytes
+  void encodeLed(uint16_t aLedIndex, uint8_t *aOutP);
+
+  /// encode a color for a LED into SPI bytes
+  /// @param aLedIndex index into the chain's pixel buffer (for per-LED calibration)
+  /// @param aRed,aGreen,aBlue 5 bit intensities, as in the pixel buffer
+  /// @param aOutP where to store P44_WS2812_BYTES_PER_LED bytes
+  void encodeColor(uint16_t aLedIndex, uint8_t aRed, uint8_t aGreen, uint8_t aBlue, uint8_t *aOutP);
+
+  /// calculate CRC32 of a word aligned buffer
+  /// @param aBufferP the buffer
+  /// @param aNumWords number of 32 bit words in the buffer
+  /// @param aUseHardware use the STM32 CRC unit when available
+  static uint32_t crc32(const void *aBufferP, size_t aNumWords, bool aUseHardware);
+
+  /// start copying the pixel buffer to the snapshot buffer
+  void startSnapshotCopy();
+
+  /// wait for the snapshot copy to complete
+  void waitSnapshotCopy();
+
+  /// block IRQs for transferring data to the LEDs
+  /// @return state to pass to unblockIrqs()
+  uint32_t blockIrqs();
+
+  /// unblock IRQs after transferring data
+  void unblockIrqs(uint32_t aState);
+
+
+};
+
+
+
+
+/// Synchronized frame presentation across multiple controllers
+/// All nodes share a common monotonic timebase (in microseconds), derived either from
+/// UDP sync packets sent by a master node, or from a periodic sync pulse on a GPIO.
+/// Frames are then presented with showAt() at a common presentation time.
+class p44_ws2812_sync {
+
+  int32_t timeOffset; // offset to add to local micros() to get sync time
+  bool synced; // set when we have received at least one sync
+  UDP udp; // for sync packets
+  uint16_t udpPort; // port for sync packets, 0 if not using UDP
+  uint32_t pulsePeriod; // sync pulse period in microseconds, 0 if not using GPIO sync
+  volatile uint32_t pulseCount; // number of sync pulses seen
+  uint32_t usPerLed256; // measured transfer time per LED, in 1/256 microseconds
+  // skew statistics
+  uint32_t frames; // number of frames presented
+  uint32_t lateFrames; // number of frames that could not be presented in time
+  uint32_t maxSkew; // max absolute skew in microseconds
+  uint32_t sumSkew; // sum of absolute skews, for average
+
+  static p44_ws2812_sync *pulseSyncP; // the instance receiving GPIO sync pulses
+  static void syncPulseISR();
+
+public:
+
+  p44_ws2812_sync();
+
+  /// use UDP sync packets as timebase
+  /// @param aPort the UDP port to receive (and as master, send) sync packets on
+  void beginUDP(uint16_t aPort);
+
+  /// use a periodic sync pulse on a GPIO as timebase
+  /// @param aPin the input pin the sync pulse is connected to
+  /// @param aPeriodMicros the period of the sync pulse in microseconds. The sync time of the n-th rising edge is n*aPeriodMicros
+  /// @note pulses are counted from the local call to beginGPIO(), so by themselves, they only provide a common phase.
+  ///   To also agree on the pulse number (epoch), use beginUDP() as well: sync packets from the master then
+  ///   correct the pulse count by whole periods (network delay must be less than half a period).
+  void beginGPIO(uint16_t aPin, uint32_t aPeriodMicros);
+
+  /// as the master node, send our time as a sync packet
+  /// @param aTarget IP address (usually the broadcast address) of the nodes to sync
+  /// @note the master's own timebase is its local time (or its pulse count when using GPIO sync), it does not
+  ///   need to receive sync packets
+  void sendSync(IPAddress aTarget);
+
+  /// process incoming sync packets, must be called regularly (e.g. from loop()) when using UDP sync
+  void process();
+
+  /// @return current sync time in microseconds
+  uint32_t syncTime();
+
+  /// @return true if timebase is synchronized
+  bool isSynced() { return synced; };
+
+  /// present a frame at a given sync time
+  /// @param aLeds the LED chain to show
+  /// @param aPresentationTime the sync time when the frame should latch into the LEDs
+  /// @return skew of the actual presentation against aPresentationTime in microseconds (positive = late)
+  /// @note transfer is started early by the (measured) transfer time of the chain, such that the end of the
+  ///   data, which is when the LEDs latch, is aligned across nodes even when chains differ in length.
+  ///   Waiting for the presentation time is a busy wait with IRQs enabled.
+  int32_t showAt(p44_ws2812 &aLeds, uint32_t aPresentationTime);
+
+  /// @name skew statistics
+  /// @{
+  uint32_t getFrames() { return frames; };
+  uint32_t getLateFrames() { return lateFrames; };
+  uint32_t getMaxSkew() { return maxSkew; };
+  uint32_t getAvgSkew() { return frames>0 ? sumSkew/frames : 0; };
+  void resetStats();
+  /// @}
+
+};
+
+
+
+/// Compact bytecode interpreter for per-pixel effect programs
+/// Programs are executed once per LED and have 8 registers r0..r7 (32 bit signed, arithmetic wraps around). Before each
+/// pixel, all registers are zero. After the program ends, r0,r1,r2 are used as red,green,blue (clamped to 0..255).
+/// Programs have no jumps, so every program terminates and runtime per pixel is bounded by its length.
+/// Code format: opcode byte, register byte (destination in high nibble, source or small immediate in low nibble),
+/// for LDI followed by a signed 16 bit immediate (little endian).
+class p44_ws2812_vm {
+
+public:
+
+  enum {
+    op_end, ///< end of program
+    op_ldi, ///< d = imm16
+    op_mov, ///< d = s
+    op_idx, ///< d = LED number
+    op_x, ///< d = X coordinate
+    op_y, ///< d = Y coordinate
+    op_time, ///< d = time as passed to run()
+    op_num, ///< d = number of LEDs
+    op_add, ///< d = d + s
+    op_sub, ///< d = d - s
+    op_mul, ///< d = d * s
+    op_div, ///< d = d / s (d = 0 if s==0)
+    op_mod, ///< d = d % s (d = 0 if s==0)
+    op_scl, ///< d = d * s >> 8 (fixed point 8.8 multiply)
+    op_and, ///< d = d & s
+    op_shl, ///< d = d << n (n = low nibble of register byte)
+    op_shr, ///< d = d >> n (n = low nibble of register byte)
+    op_min, ///< d = min(d,s)
+    op_max, ///< d = max(d,s)
+    op_sin, ///< d = sine of d, one period per 256, result 0..255
+    op_wheel, ///< r0,r1,r2 = color on red-green-blue hue wheel at d, one revolution per 256
+    op_dim, ///< r0,r1,r2 scaled by d (0..255)
+    numOpcodes
+  };
+
+  /// maximum size of a program in bytes
+  static const uint16_t maxCodeSize = 128;
+
+private:
+
+  uint8_t code[maxCodeSize]; // the loaded program
+  uint16_t codeSize; // size of the loaded program, 0 if none
+  // upload receiver state
+  uint8_t rxState; // 0 = waiting for start, 1 = waiting for length, 2 = receiving code, 3 = waiting for checksum
+  uint8_t rxBuffer[maxCodeSize];
+  uint16_t rxLen; // expected length
+  uint16_t rxCount; // received so far
+  uint8_t rxSum; // checksum of received bytes
+
+public:
+
+  p44_ws2812_vm();
+
+  /// load a program
+  /// @param aCodeP the bytecode, will be copied
+  /// @param aCodeSize size of the bytecode in bytes
+  /// @return false if the program is not valid (in which case the previously loaded program remains active)
+  bool load(const uint8_t *aCodeP, uint16_t aCodeSize);
+
+  /// receive programs from a stream (Serial, TCPClient etc.), must be called regularly
+  /// Upload format: 0xA5, length byte, code bytes, checksum (8 bit sum of all code bytes)
+  /// @return true if a new program has been loaded
+  bool receive(Stream &aStream);
+
+  /// @return true if a program is loaded
+  bool hasProgram() { return codeSize>0; };
+
+  /// run the program for all LEDs in a chain
+  /// @param aLeds the LEDs to render into
+  /// @param aTime time value available to the program via op_time
+  void run(p44_ws2812 &aLeds, uint32_t aTime);
+
+  /// measure interpreter throughput
+  /// @param aLeds the LEDs to render into
+  /// @param aRuns number of times to run the program over all LEDs
+  /// @return LEDs per millisecond
+  uint32_t benchmark(p44_ws2812 &aLeds, uint16_t aRuns);
+
+};
+
+
+
+/// Base class for stages of pixel pipelines, to be used with p44_ws2812::process() and showProcessed()
+/// Stages are combined with operator| into pipelines that are expanded at compile time, such that
+/// all stages of a pipeline are applied in a single pass over the LEDs without temporary buffers.
+/// Stages can modify colors by overriding color(), and/or remap LEDs by setting remapping to true
+/// and overriding map(). Remapping stages must only map to the same or lower LED numbers.
+/// Stages whose color() depends on aLedIndex must set positional to true. They see the LED their
+/// output goes to, which is where a later remapping stage takes the color from. Pipelines with more
+/// than one remapping stage can't contain positional stages.
+template<class S> class p44_ws2812_stage {
+public:
+  /// set to true in derived stages that remap LEDs
+  static const bool remapping = false;
+  /// set to true in derived stages whose color modification depends on the LED
+  static const bool positional = false;
+  /// @return LED number to take the color from for aLedNumber
+  uint16_t map(uint16_t aLedNumber) const { return aLedNumber; };
+  /// modify color
+  /// @param aLedIndex index in the pixel buffer of the LED the stage's output is for
+  /// @param aColor color to modify
+  void color(uint16_t aLedIndex, p44_ws2812::RGBColor &aColor) const { };
+  /// apply color modifications, used by p44_ws2812::process() and showProcessed()
+  /// @param aSrcIndex index in the pixel buffer of the LED the color is taken from
+  /// @param aDstIndex index in the pixel buffer of the LED the color goes to
+  /// @param aColor color to modify
+  void apply(uint16_t aSrcIndex, uint16_t aDstIndex, p44_ws2812::RGBColor &aColor) const { stage().color(aDstIndex, aColor); };
+  /// @return the derived stage
+  const S &stage() const { return *static_cast<const S *>(this); };
+};
+
+
+/// two stages applied one after the other, usually created with operator|
+template<class A, class B> class p44_ws2812_pipe : public p44_ws2812_stage< p44_ws2812_pipe<A,B> > {
+  A a;
+  B b;
+public:
+  static const bool remapping = A::remapping || B::remapping;
+  static const bool positional = A::positional || B::positional;
+  // with both A and B remapping, the LED between them is not known to apply()
+  static_assert(!(A::remapping && B::remapping && positional), "positional stages can't be combined with two remapping stages");
+  p44_ws2812_pipe(const A &aA, const B &aB) : a(aA), b(aB) {};
+  // color of LED n after A then B is the color of LED a.map(b.map(n)), with A's then B's color modifications applied
+  uint16_t map(uint16_t aLedNumber) const { return a.map(b.map(aLedNumber)); };
+  // A's output goes to the LED B takes its color from
+  void apply(uint16_t aSrcIndex, uint16_t aDstIndex, p44_ws2812::RGBColor &aColor) const {
+    uint16_t mid = B::remapping ? aSrcIndex : aDstIndex;
+    a.apply(aSrcIndex, mid, aColor);
+    b.apply(mid, aDstIndex, aColor);
+  };
+};
+
+template<class A, class B> p44_ws2812_pipe<A,B> operator|(const p44_ws2812_stage<A> &aA, const p44_ws2812_stage<B> &aB)
+{
+  return p44_ws2812_pipe<A,B>(aA.stage(), aB.stage());
+}
+
+
+/// scale brightness
+class p44_ws2812_fade : public p44_ws2812_stage<p44_ws2812_fade> {
+  uint16_t factor;
+public:
+  /// @param aBrightness 0..255
+  p44_ws2812_fade(byte aBrightness) : factor(aBrightness+1) {};
+  void color(uint16_t aLedIndex, p44_ws2812::RGBColor &aColor) const {
+    aColor.red = (aColor.red*factor)>>8;
+    aColor.green = (aColor.green*factor)>>8;
+    aColor.blue = (aColor.blue*factor)>>8;
+  };
+};
+
+
+/// mirror first half of the LEDs onto the second half
+class p44_ws2812_mirror : public p44_ws2812_stage<p44_ws2812_mirror> {
+  uint16_t numLeds;
+public:
+  static const bool remapping = true;
+  /// @param aNumLeds number of LEDs to mirror (usually all LEDs of the chain or segment)
+  p44_ws2812_mirror(uint16_t aNumLeds) : numLeds(aNumLeds) {};
+  uint16_t map(uint16_t aLedNumber) const { return aLedNumber>=(numLeds+1)/2 && aLedNumber<numLeds ? numLeds-1-aLedNumber : aLedNumber; };
+};
+
+
+/// increase contrast by applying show()'s perceptual brightness curve to the colors
+/// @note show() still applies the curve when encoding, so this bends the brightness curve a second time
+class p44_ws2812_contrast : public p44_ws2812_stage<p44_ws2812_contrast> {
+public:
+  void color(uint16_t aLedIndex, p44_ws2812::RGBColor &aColor) const;
+};
+
+
+/// blend with the colors of another chain or segment with the same number of LEDs
+class p44_ws2812_blend : public p44_ws2812_stage<p44_ws2812_blend> {
+  p44_ws2812 &other;
+  uint16_t amount;
+public:
+  static const bool positional = true;
+  /// @param aOther the chain or segment to blend with
+  /// @param aAmount 0 = only this chain's color, 255 = only aOther's color
+  p44_ws2812_blend(p44_ws2812 &aOther, byte aAmount) : other(aOther), amount(aAmount+1) {};
+  void color(uint16_t aLedIndex, p44_ws2812::RGBColor &aColor) const {
+    p44_ws2812::RGBColor o = aColor;
+    other.getPixel(aLedIndex, o);
+    aColor.red += ((o.red-aColor.red)*amount)>>8;
+    aColor.green += ((o.green-aColor.green)*amount)>>8;
+    aColor.blue += ((o.blue-aColor.blue)*amount)>>8;
+  };
+};
+
+
+
+/// Art-Net receiver feeding universes directly into LED chains or segments
+/// Each output covers consecutive universes of 170 LEDs (510 DMX channels) each. DMX data is
+/// read from the UDP socket in small chunks and written straight to the pixel buffer.
+class p44_ws2812_artnet {
+
+  static const uint8_t maxOutputs = 4;
+  static const uint8_t maxUniversesPerOutput = 32;
+  static const uint16_t ledsPerUniverse = 170;
+
+  typedef struct {
+    p44_ws2812 *ledsP; // the chain or segment to feed
+    uint16_t firstUniverse; // first universe (15 bit port address)
+    uint8_t numUniverses; // number of universes
+    uint32_t receivedMask; // universes received for the current frame
+    uint8_t lastSequence[maxUniversesPerOutput]; // last Art-Net sequence number per universe, for drop detection
+  } Output;
+
+  UDP udp;
+  Output outputs[maxOutputs];
+  uint8_t numOutputs;
+  // statistics
+  uint32_t packets; // valid ArtDmx packets received
+  uint32_t dropped; // packets detected as missing from sequence numbers
+  uint32_t invalid; // packets ignored
+
+public:
+
+  p44_ws2812_artnet();
+
+  /// start receiving
+  /// @param aPort UDP port, default is the standard Art-Net port
+  void begin(uint16_t aPort=6454);
+
+  /// add an output
+  /// @param aLeds the chain or segment to feed
+  /// @param aFirstUniverse the universe (15 bit Art-Net port address) of the first 170 LEDs
+  /// @return output number, or -1 if no more outputs can be added
+  int addOutput(p44_ws2812 &aLeds, uint16_t aFirstUniverse);
+
+  /// process all pending packets, must be called regularly (e.g. from loop())
+  /// @return bitmask of outputs for which a frame has been completed (all universes received)
+  uint8_t process();
+
+  /// @name statistics
+  /// @{
+  uint32_t getPackets() { return packets; };
+  uint32_t getDropped() { return dropped; };
+  uint32_t getInvalid() { return invalid; };
+  /// @}
+
+};
+
+
+
+/// Bit-parallel cellular automaton for life-like rules (Conway's life is B3/S23)
+/// Cells are packed 32 per word, and neighbour counts for all 32 cells of a word are computed at once with
+/// a bit-sliced adder tree, so a generation costs a few dozen word operations per 32 cells.
+/// Cells are rendered through a palette by age (number of rendered frames a cell has been alive).
+class p44_ws2812_life {
+
+  uint16_t width; // in cells
+  uint16_t height; // in cells
+  uint16_t wordsPerRow; // 32 cells per word
+  uint32_t *cellsP; // current generation, wordsPerRow*height words
+  uint32_t *nextP; // next generation is built here, then swapped with cellsP
+  uint8_t *ageP; // per cell age, width*height bytes
+  uint16_t birthMask; // bit n set: dead cell with n neighbours becomes alive
+  uint16_t surviveMask; // bit n set: live cell with n neighbours stays alive
+  bool wrap; // edges wrap around (torus)
+  bool fullRender; // next render() must write all cells
+  uint32_t generation; // number of generations since clear()
+  uint32_t seed; // random generator state
+
+  // get the cells to the left, the cells themselves and the cells to the right of word aWord in a row
+  void rowWord(const uint32_t *aRowP, uint16_t aWord, uint32_t &aLeft, uint32_t &aCenter, uint32_t &aRight);
+
+public:
+
+  /// create automaton
+  /// @param aWidth number of cells per row
+  /// @param aHeight number of rows
+  /// @param aWrap if set, edges wrap around, otherwise cells outside are always dead
+  p44_ws2812_life(uint16_t aWidth, uint16_t aHeight, bool aWrap=true);
+
+  /// destructor
+  ~p44_ws2812_life();
+
+  /// set rule from masks
+  /// @param aBirthMask bit n set means a dead cell with n (0..8) live neighbours becomes alive
+  /// @param aSurviveMask bit n set means a live cell with n live neighbours stays alive
+  void setRule(uint16_t aBirthMask, uint16_t aSurviveMask);
+
+  /// set rule from a rule string such as "B3/S23" (life), "B36/S23" (high life) or "B2/S" (seeds)
+  /// @return false if the string is not valid (in which case the rule remains unchanged)
+  bool setRule(const char *aRule);
+
+  /// kill all cells
+  void clear();
+
+  /// randomly populate all cells
+  /// @param aDensity probability for a cell to be alive, 0..255
+  void randomize(uint8_t aDensity=80);
+
+  /// set a single cell
+  void setCell(uint16_t aX, uint16_t aY, bool aAlive);
+
+  /// @return true if cell is alive
+  bool getCell(uint16_t aX, uint16_t aY);
+
+  /// calculate the next generation
+  void step();
+
+  /// @return number of generations since clear() or randomize()
+  uint32_t getGeneration() { return generation; };
+
+  /// @return number of live cells
+  uint32_t getPopulation();
+
+  /// render cells into LEDs, cell (x,y) goes to setColorXY(x,y)
+  /// @param aLeds the chain or segment to render into
+  /// @param aPalette colors for live cells by age, the last color is used for all older cells
+  /// @param aNumColors number of colors in aPalette
+  /// @note dead cells are black. Only cells that are alive or have just died are written.
+  void render(p44_ws2812 &aLeds, const p44_ws2812::RGBColor *aPalette, uint8_t aNumColors);
+
+  /// @return true if memory for the cells could be allocated
+  bool isValid() { return cellsP!=NULL; };
+
+};
+
+
+
+/// Sparkle engine animating a small set of twinkling LEDs
+/// Only the active twinkles are updated each frame, so cost depends on the number of twinkles, not on the
+/// length of the chain. As all writes go through setColor(), only the twinkling LEDs are marked dirty
+/// (and re-encoded when an encode buffer is enabled).
+class p44_ws2812_sparkle {
+
+public:
+
+  /// maximum number of simultaneously active twinkles
+  static const uint8_t maxTwinkles = 64;
+
+private:
+
+  typedef struct {
+    uint16_t ledNumber; // the twinkling LED
+    uint16_t phase; // 0..65535 is one fade in and out
+    uint16_t speed; // phase increment per frame
+    p44_ws2812::RGBColor color; // peak color
+  } Twinkle;
+
+  Twinkle twinkles[maxTwinkles];
+  uint8_t numActive; // active twinkles are twinkles[0..numActive-1]
+  p44_ws2812::RGBColor background; // color of LEDs not twinkling
+  const p44_ws2812::RGBColor *paletteP; // colors for spawned twinkles, NULL for white
+  uint8_t numColors; // number of colors in paletteP
+  uint16_t spawnRate; // new twinkles per frame, 8.8 fixed point
+  uint16_t spawnAccumulator; // fractional twinkles not yet spawned, 8.8 fixed point
+  uint16_t minSpeed; // range for speed of spawned twinkles
+  uint16_t maxSpeed;
+  uint32_t seed; // random generator state
+
+public:
+
+  p44_ws2812_sparkle();
+
+  /// set rate of new twinkles
+  /// @param aPerFrame average number of new twinkles per call to update(), 8.8 fixed point (256 = one per frame)
+  /// @param aMinSpeed minimal phase increment per frame (65536/aMinSpeed is the longest twinkle in frames)
+  /// @param aMaxSpeed maximal phase increment per frame
+  void setRate(uint16_t aPerFrame, uint16_t aMinSpeed=1024, uint16_t aMaxSpeed=4096);
+
+  /// set colors for spawned twinkles
+  /// @param aPalette colors to randomly choose from, must remain valid. NULL for white.
+  /// @param aNumColors number of colors in aPalette
+  void setColors(const p44_ws2812::RGBColor *aPalette, uint8_t aNumColors);
+
+  /// set background color
+  /// @note the background is only written to LEDs when their twinkle ends, use fill() to initially set it
+  void setBackground(byte aRed, byte aGreen, byte aBlue);
+
+  /// start a twinkle
+  /// @param aLedNumber the LED
+  /// @param aColor peak color
+  /// @param aSpeed phase increment per frame
+  /// @return false if too many twinkles are active already, or if the LED is already twinkling
+  bool spawn(uint16_t aLedNumber, const p44_ws2812::RGBColor &aColor, uint16_t aSpeed);
+
+  /// advance all twinkles by one frame, spawn new ones and write them to the LEDs
+  /// @param aLeds the chain or segment to draw into
+  void update(p44_ws2812 &aLeds);
+
+  /// end all twinkles and restore the background
+  /// @param aLeds the chain or segment to draw into
+  void clear(p44_ws2812 &aLeds);
+
+  /// @return number of active twinkles
+  uint8_t getNumActive() { return numActive; };
+
+};
+
+
+
+/// Base class for effects rendered progressively, see p44_ws2812::renderProgressive()
+/// Renderers are explicit state machines: they keep track of how far they got in their own member variables,
+/// and render one chunk (e.g. a few rows, or one pass of a multi pass filter) per call to renderChunk().
+class p44_ws2812_renderer {
+
+public:
+
+  virtual ~p44_ws2812_renderer() {};
+
+  /// start rendering a new frame
+  /// @param aLeds the chain or segment to render into
+  virtual void startFrame(p44_ws2812 &aLeds) {};
+
+  /// render the next chunk of the frame
+  /// @param aLeds the chain or segment to render into
+  /// @return true when the frame is complete
+  /// @note chunks should be short compared to the budget passed to renderProgressive()
+  virtual bool renderChunk(p44_ws2812 &aLeds) = 0;
+
+};
+
+
+
+/// Preview of LED frames on a terminal (ANSI truecolor) or as a PPM image sequence, with timing overlay
+/// The frame is decoded from what show() transfers and laid out in rows as mapped by the chain's layout.
+/// Output to Serial (USB) allows developing effects without looking at actual LEDs; the overlay shows
+/// render time, show() time and the bus time for the chain against the frame budget.
+class p44_ws2812_preview {
+
+  Print &output;
+  bool ppm; // output binary PPM images instead of ANSI text
+  uint32_t frameBudget; // time available per frame in uS
+  uint32_t renderStart; // micros() when rendering of the current frame started
+
+public:
+
+  /// create preview
+  /// @param aOutput where to send the preview (e.g. Serial)
+  /// @param aFrameBudgetMicros time available per frame, 16667 for 60fps
+  /// @param aPPM if set, frames are output as binary PPM (P6) images, e.g. for piping into ffmpeg.
+  ///   Otherwise, frames are drawn on an ANSI truecolor terminal, each redrawing the previous one.
+  p44_ws2812_preview(Print &aOutput, uint32_t aFrameBudgetMicros=16667, bool aPPM=false);
+
+  /// call before rendering a frame, to measure render time
+  void startFrame();
+
+  /// show a frame (calls aLeds.show()) and output its preview
+  /// @param aLeds the chain or segment to show
+  void show(p44_ws2812 &aLeds);
+
+};
+
+
+// Implementation (would go to .cpp file once library is separated)
+// ================================================================
+
+static const uint8_t pwmTable[32] = {0, 1, 1, 2, 3, 4, 6, 7, 9, 10, 13, 15, 18, 21, 24, 28, 33, 38, 44, 50, 58, 67, 77, 88, 101, 115, 132, 150, 172, 196, 224, 255};
+
+#if P44_WS2812_ARENA_SIZE>0
+static uint32_t ws2812Arena[(P44_WS2812_ARENA_SIZE+3)/4]; // word aligned
+uint8_t *p44_ws2812::arenaP = (uint8_t *)ws2812Arena;
+size_t p44_ws2812::arenaSize = sizeof(ws2812Arena);
+#else
+uint8_t *p44_ws2812::arenaP = NULL;
+size_t p44_ws2812::arenaSize = 0;
+#endif
+size_t p44_ws2812::arenaUsed = 0;
+size_t p44_ws2812::ramUsed = 0;
+
+
+bool p44_ws2812::setArena(void *aArenaP, size_t aArenaSize)
+{
+  if (ramUsed>0) return false; // buffers already allocated elsewhere
+  if (((uintptr_t)aArenaP & (P44_WS2812_BUFFER_ALIGN-1))!=0) return false; // buffers must be DMA aligned
+  arenaP = (uint8_t *)aArenaP;
+  arenaSize = aArenaP ? aArenaSize : 0;
+  return true;
+}
+
+
+size_t p44_ws2812::getRamUsage()
+{
+  return ramUsed;
+}
+
+
+size_t p44_ws2812::getArenaFree()
+{
+  return arenaSize-arenaUsed;
+}
+
+
+void *p44_ws2812::allocBuffer(size_t aSize)
+{
+  void *bufP;
+  // round up to keep next buffer aligned as well
+  aSize = (aSize+P44_WS2812_BUFFER_ALIGN-1) & ~(size_t)(P44_WS2812_BUFFER_ALIGN-1);
+  if (arenaP) {
+    // from the arena
+    if (aSize>arenaSize-arenaUsed) return NULL; // budget exceeded
+    bufP = arenaP+arenaUsed;
+    arenaUsed += aSize;
+  }
+  else {
+    // from the heap, uint32_t makes sure it is word aligned
+    if ((bufP = new uint32_t[aSize/4])==NULL) return NULL;
+  }
+  ramUsed += aSize;
+  memset(bufP, 0, aSize);
+  return bufP;
+}
+
+
+void p44_ws2812::freeBuffer(void *aBufferP, size_t aSize)
+{
+  if (!aBufferP) return;
+  aSize = (aSize+P44_WS2812_BUFFER_ALIGN-1) & ~(size_t)(P44_WS2812_BUFFER_ALIGN-1);
+  ramUsed -= aSize;
+  if (arenaP) {
+    // arena buffers can only be returned when they are the last ones allocated
+    if ((uint8_t *)aBufferP+aSize==arenaP+arenaUsed) arenaUsed -= aSize;
+  }
+  else {
+    delete[] (uint32_t *)aBufferP;
+  }
+}
+
+
+p44_ws2812::p44_ws2812(uint16_t aNumLeds, uint16_t aLedsPerRow, bool aXReversed, bool aAlternating)
+{
+  numLeds = aNumLeds;
+  if (aLedsPerRow==0)
+    ledsPerRow = aNumLeds; // single row
+  else
+    ledsPerRow = aLedsPerRow; // set row size
+  xReversed = aXReversed;
+  alternating = aAlternating;
+  layoutRunsP = NULL; // regular layout
+  numLayoutRuns = 0;
+  cachedRun = 0;
+  cachedRunStart = 0;
+  blurScratchP = NULL; // allocated on first use
+  blurScratchLen = 0;
+  chainP = NULL; // this is a chain by itself
+  firstLed = 0;
+  corrRed = 255; corrGreen = 255; corrBlue = 255; // no color correction
+  dirtyEnd = aNumLeds; // first show() must transfer all LEDs
+  calibrationP = NULL; // no calibration
+  calibrationBits = 8;
+  encodeBufferP = NULL; // encode on the fly
+  snapshotBufferP = NULL; // not double buffered
+  snapshotDirtyEnd = 0;
+  snapshotTaken = false;
+  snapshotCopying = false;
+  frameStatsP = NULL; // no statistics
+  skipUnchanged = false;
+  fingerprintValid = false;
+  lastFingerprint = 0;
+  irqPriorityThreshold = 0; // block all IRQs during show()
+  thermalP = NULL; // no thermal model
+  thermalShift = 0;
+  thermalLimit = 255;
+  thermalTau = 0;
+  rendererP = NULL; // no progressive frame in progress
+  renderDone = false;
+  renderCommit = 0;
+  rendersInProgress = 0;
+  renderCommits = 0;
+  // allocate the buffer (zeroed = all LEDs off)
+  if ((pixelBufferP = (RGBPixel *)allocBuffer(sizeof(RGBPixel)*numLeds))==NULL) {
+    numLeds = 0; // no buffer, no LEDs
+  }
+}
+
+p44_ws2812::p44_ws2812(p44_ws2812 &aChain, uint16_t aFirstLed, uint16_t aNumLeds, uint16_t aLedsPerRow, bool aXReversed, bool aAlternating)
+{
+  // always refer to the chain itself, even when created from another segment
+  chainP = aChain.chainP ? aChain.chainP : &aChain;
+  firstLed = aChain.firstLed + aFirstLed;
+  // limit to LEDs available in the parent
+  if (aFirstLed>=aChain.numLeds)
+    numLeds = 0;
+  else if (aNumLeds>aChain.numLeds-aFirstLed)
+    numLeds = aChain.numLeds-aFirstLed;
+  else
+    numLeds = aNumLeds;
+  if (aLedsPerRow==0)
+    ledsPerRow = numLeds>0 ? numLeds : 1; // single row
+  else
+    ledsPerRow = aLedsPerRow; // set row size
+  xReversed = aXReversed;
+  alternating = aAlternating;
+  layoutRunsP = NULL; // regular layout
+  numLayoutRuns = 0;
+  cachedRun = 0;
+  cachedRunStart = 0;
+  blurScratchP = NULL; // allocated on first use
+  blurScratchLen = 0;
+  corrRed = 255; corrGreen = 255; corrBlue = 255; // no color correction
+  dirtyEnd = 0; // not used in segments
+  calibrationP = NULL; // not used in segments
+  calibrationBits = 8;
+  encodeBufferP = NULL; // not used in segments
+  snapshotBufferP = NULL; // not used in segments
+  snapshotDirtyEnd = 0;
+  snapshotTaken = false;
+  snapshotCopying = false;
+  frameStatsP = NULL; // not used in segments
+  skipUnchanged = false; // not used in segments
+  fingerprintValid = false;
+  lastFingerprint = 0;
+  irqPriorityThreshold = 0; // not used in segments
+  thermalP = NULL; // not used in segments
+  thermalShift = 0;
+  thermalLimit = 255;
+  thermalTau = 0;
+  rendererP = NULL; // no progressive frame in progress
+  renderDone = false;
+  renderCommit = 0;
+  rendersInProgress = 0;
+  renderCommits = 0;
+  // use our range of the chain's buffer
+  pixelBufferP = chainP->pixelBufferP ? chainP->pixelBufferP+firstLed : NULL;
+  if (!pixelBufferP) numLeds = 0;
+}
+
+p44_ws2812::~p44_ws2812()
+{
+  cancelProgressive(); // don't hold back the chain's progressive frames
+  freeBuffer(blurScratchP, 3*sizeof(uint16_t)*blurScratchLen);
+  // free the buffers (segments do not own theirs)
+  if (!chainP) {
+    if (snapshotBufferP) waitSnapshotCopy();
+    freeBuffer(snapshotBufferP, sizeof(RGBPixel)*numLeds);
+    freeBuffer(frameStatsP, sizeof(FrameStats));
+    if (thermalP) freeBuffer(thermalP, sizeof(ThermalRegion)*(((numLeds-1)>>thermalShift)+1));
+    freeBuffer(encodeBufferP, P44_WS2812_BYTES_PER_LED*numLeds);
+    freeBuffer(pixelBufferP, sizeof(RGBPixel)*numLeds);
+  }
+}
+
+
+int p44_ws2812::getNumLeds()
+{
+  return numLeds;
+}
+
+
+int p44_ws2812::getChainNumLeds()
+{
+  return chainP ? chainP->numLeds : numLeds;
+}
+
+
+int p44_ws2812::getLedsPerRow()
+{
+  return ledsPerRow;
+}
+
+
+void p44_ws2812::setColorCorrection(byte aRed, byte aGreen, byte aBlue)
+{
+  corrRed = aRed;
+  corrGreen = aGreen;
+  corrBlue = aBlue;
+}
+
+
+void p44_ws2812::begin()
+{
+  // segments use the chain's hardware
+  if (chainP) return;
+  // begin using the driver
+  SPI.begin();
+  SPI.setClockDivider(SPI_CLOCK_DIV8); // System clock is 72MHz, we need 9MHz for SPI
+  SPI.setBitOrder(MSBFIRST); // MSB first for easier scope reading :-)
+  SPI.transfer(0); // make sure SPI line starts low (Note: SPI line remains at level of last sent bit, fortunately)
+}
+
+void p44_ws2812::show()
+{
+  // segments always transfer the entire chain
+  if (chainP) {
+    chainP->show();
+    return;
+  }
+  if (frameStatsP) {
+    // frame interval statistics
+    uint32_t now = micros();
+    FrameStats &fs = *frameStatsP;
+    if (fs.lastShow!=0) {
+      uint32_t interval = now-fs.lastShow;
+      if (fs.frames==0 || interval<fs.minInterval) fs.minInterval = interval;
+      if (interval>fs.maxInterval) fs.maxInterval = interval;
+      uint32_t dev = interval>fs.targetInterval ? interval-fs.targetInterval : fs.targetInterval-interval;
+      uint8_t b = 0;
+      dev >>= 4;
+      while (dev>0 && b<jitterBuckets-1) { dev >>= 1; b++; }
+      fs.jitter[b]++;
+      fs.frames++;
+    }
+    fs.lastShow = now;
+  }
+  // Note: on the spark core, system IRQs might happen which exceed 50uS
+  // causing WS2812 chips to reset in midst of data stream.
+  // Thus, until we can send via DMA, we need to disable IRQs while sending,
+  // or at least those which might take longer than getMaxIrqNanos()
+  if (thermalP) updateThermalModel();
+  RGBPixel *srcP = pixelBufferP;
+  uint16_t n;
+  if (snapshotBufferP) {
+    // transfer from snapshot
+    if (!snapshotTaken && rendersInProgress==0) snapshot(); // otherwise, repeat last committed frame
+    waitSnapshotCopy();
+    snapshotTaken = false;
+    srcP = snapshotBufferP;
+    n = snapshotDirtyEnd;
+  }
+  else {
+    n = dirtyEnd;
+    dirtyEnd = 0;
+  }
+  if (n>numLeds) n = numLeds;
+  if (skipUnchanged) {
+    // check if anything actually changed since last transfer
+    uint32_t fp = crc32(srcP, (sizeof(RGBPixel)*numLeds+3)/4, true);
+    if (fingerprintValid && fp==lastFingerprint) return; // no changes
+    lastFingerprint = fp;
+    fingerprintValid = true;
+  }
+  uint32_t irqState = blockIrqs();
+  // transfer RGB values to LED chain, up to the last modified LED
+  if (encodeBufferP) {
+    // already encoded
+    uint8_t *p = encodeBufferP;
+    uint8_t *e = encodeBufferP+P44_WS2812_BYTES_PER_LED*n;
+    while (p<e) SPI.transfer(*p++);
+  }
+  else {
+    // encode on the fly
+    uint8_t enc[P44_WS2812_BYTES_PER_LED];
+    for (uint16_t i=0; i<n; i++) {
+      RGBPixel *pixP = &(srcP[i]);
+      encodeColor(i, pixP->red, pixP->green, pixP->blue, enc);
+      for (uint8_t j=0; j<P44_WS2812_BYTES_PER_LED; j++) SPI.transfer(enc[j]);
+    }
+  }
+  unblockIrqs(irqState);
+}
+
+
+uint32_t p44_ws2812::blockIrqs()
+{
+  uint32_t oldBasePri = 0;
+  if (irqPriorityThreshold) {
+    oldBasePri = __get_BASEPRI();
+    __set_BASEPRI(irqPriorityThreshold<<(8-__NVIC_PRIO_BITS));
+  }
+  else {
+    __disable_irq();
+  }
+  return oldBasePri;
+}
+
+
+void p44_ws2812::unblockIrqs(uint32_t aState)
+{
+  if (irqPriorityThreshold)
+    __set_BASEPRI(aState);
+  else
+    __enable_irq();
+}
+
+
+void p44_ws2812::setIrqPriorityThreshold(uint8_t aPriority)
+{
+  if (chainP)
+    chainP->setIrqPriorityThreshold(aPriority);
+  else
+    irqPriorityThreshold = aPriority<(1<<__NVIC_PRIO_BITS) ? aPriority : (1<<__NVIC_PRIO_BITS)-1; // BASEPRI only has __NVIC_PRIO_BITS
+}
+
+
+uint32_t p44_ws2812::getMaxIrqNanos()
+{
+  // Both bit patterns end low (0x7E: 6 high, 2 low / 0x70: 3 high, 5 low SPI bits at 9MHz), and the
+  // SPI line stays low while the CPU is away. So an IRQ extends the low phase of the current bit,
+  // worst case following a 0 bit which is already low for 5 SPI bits.
+  const uint32_t spiBitNanos = 1000/9; // 9MHz SPI clock
+  const uint32_t irqOverheadNanos = 24*1000/72; // 12 cycles each for IRQ entry and exit at 72MHz
+  return (uint32_t)P44_WS2812_RESET_MICROS*1000 - 5*spiBitNanos - irqOverheadNanos;
+}
+
+
+static inline void encodeByte(byte aByte, uint8_t *&aOutP)
+{
+  for (byte j=0; j<8; j++) {
+    *aOutP++ = aByte & 0x80 ? 0x7E : 0x70;
+    aByte = aByte << 1;
+  }
+}
+
+
+void p44_ws2812::encodeLed(uint16_t aLedIndex, uint8_t *aOutP)
+{
+  RGBPixel *pixP = &(pixelBufferP[aLedIndex]);
+  encodeColor(aLedIndex, pixP->red, pixP->green, pixP->blue, aOutP);
+}
+
+
+void p44_ws2812::encodeColor(uint16_t aLedIndex, uint8_t aRed, uint8_t aGreen, uint8_t aBlue, uint8_t *aOutP)
+{
+  uint16_t r = pwmTable[aRed];
+  uint16_t g = pwmTable[aGreen];
+  uint16_t b = pwmTable[aBlue];
+  if (calibrationP) {
+    // apply per-LED calibration to PWM duty cycle
+    if (calibrationBits==4) {
+      const uint8_t *calP = calibrationP+2*aLedIndex;
+      r = (r*(136+((calP[0]>>1) & 0x78)))>>8;
+      g = (g*(136+((calP[0]<<3) & 0x78)))>>8;
+      b = (b*(136+((calP[1]>>1) & 0x78)))>>8;
+    }
+    else {
+      const uint8_t *calP = calibrationP+3*aLedIndex;
+      r = (r*(calP[0]+1))>>8;
+      g = (g*(calP[1]+1))>>8;
+      b = (b*(calP[2]+1))>>8;
+    }
+  }
+  if (thermalP) {
+    uint16_t f = thermalP[aLedIndex>>thermalShift].derating;
+    if (f<255) {
+      r = (r*(f+1))>>8;
+      g = (g*(f+1))>>8;
+      b = (b*(f+1))>>8;
+    }
+  }
+  // Order of PWM data for WS2812 LEDs is G-R-B
+  encodeByte(g, aOutP);
+  encodeByte(r, aOutP);
+  encodeByte(b, aOutP);
+}
+
+
+bool p44_ws2812::enableDoubleBuffer()
+{
+  if (chainP) return chainP->enableDoubleBuffer();
+  if (snapshotBufferP) return true; // already enabled
+  if (encodeBufferP) return false; // encode buffer is updated live, can't be combined with snapshots
+  if ((snapshotBufferP = (RGBPixel *)allocBuffer(sizeof(RGBPixel)*numLeds))==NULL) return false;
+  snapshotTaken = false;
+  return true;
+}
+
+
+void p44_ws2812::snapshot()
+{
+  if (chainP) {
+    chainP->snapshot();
+    return;
+  }
+  if (!snapshotBufferP) return;
+  waitSnapshotCopy(); // previous copy must be complete
+  // LEDs modified since last show() and not yet transferred must be included
+  if (!snapshotTaken || dirtyEnd>snapshotDirtyEnd) snapshotDirtyEnd = dirtyEnd;
+  dirtyEnd = 0;
+  snapshotTaken = true;
+  startSnapshotCopy();
+}
+
+
+bool p44_ws2812::renderProgressive(p44_ws2812_renderer &aRenderer, uint32_t aBudgetMicros)
+{
+  p44_ws2812 *cP = chainP ? chainP : this;
+  if (rendererP && rendererP!=&aRenderer) cancelProgressive(); // switched to another renderer
+  if (rendererP && renderDone) {
+    // completed frame waiting for other progressive frames in the chain
+    if (renderCommit==cP->renderCommits) return false;
+    rendererP = NULL;
+  }
+  if (!rendererP) {
+    // start new frame
+    rendererP = &aRenderer;
+    renderDone = false;
+    cP->rendersInProgress++;
+    aRenderer.startFrame(*this);
+  }
+  uint32_t start = micros();
+  do {
+    renderDone = rendererP->renderChunk(*this);
+  } while (!renderDone && (!cP->snapshotBufferP || micros()-start<aBudgetMicros));
+  if (!renderDone) return false;
+  // frame complete, commit if it was the last one in progress
+  renderCommit = cP->renderCommits;
+  if (--cP->rendersInProgress==0) {
+    cP->renderCommits++;
+    cP->snapshot();
+  }
+  return true;
+}
+
+
+void p44_ws2812::cancelProgressive()
+{
+  if (!rendererP) return;
+  p44_ws2812 *cP = chainP ? chainP : this;
+  if (!renderDone && --cP->rendersInProgress==0) {
+    // commit the frames that were waiting for this one
+    cP->renderCommits++;
+    cP->snapshot();
+  }
+  rendererP = NULL;
+  renderDone = false;
+}
+
+
+#ifdef P44_WS2812_M2M_DMA
+
+void p44_ws2812::startSnapshotCopy()
+{
+  // memory-to-memory DMA, 32 bit words (buffers are word aligned and their size is rounded up to words)
+  RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+  P44_WS2812_M2M_DMA->CCR = 0;
+  DMA1->IFCR = P44_WS2812_M2M_DMA_CLEAR;
+  P44_WS2812_M2M_DMA->CPAR = (uint32_t)pixelBufferP;
+  P44_WS2812_M2M_DMA->CMAR = (uint32_t)snapshotBufferP;
+  P44_WS2812_M2M_DMA->CNDTR = (sizeof(RGBPixel)*numLeds+3)/4;
+  P44_WS2812_M2M_DMA->CCR =
+    DMA_CCR1_MEM2MEM | DMA_CCR1_PL_0 | // memory-to-memory, medium priority
+    DMA_CCR1_MSIZE_1 | DMA_CCR1_PSIZE_1 | // 32 bit
+    DMA_CCR1_MINC | DMA_CCR1_PINC | // increment both addresses
+    DMA_CCR1_EN;
+  snapshotCopying = true;
+}
+
+
+void p44_ws2812::waitSnapshotCopy()
+{
+  if ((P44_WS2812_M2M_DMA->CCR & DMA_CCR1_EN)==0) return; // no copy running
+  while ((DMA1->ISR & P44_WS2812_M2M_DMA_TCIF)==0);
+  P44_WS2812_M2M_DMA->CCR = 0;
+  DMA1->IFCR = P44_WS2812_M2M_DMA_CLEAR;
+  snapshotCopying = false;
+}
+
+#else
+
+// no DMA available, copy synchronously
+void p44_ws2812::startSnapshotCopy()
+{
+  memcpy(snapshotBufferP, pixelBufferP, sizeof(RGBPixel)*numLeds);
+}
+
+
+void p44_ws2812::waitSnapshotCopy()
+{
+}
+
+#endif // P44_WS2812_M2M_DMA
+
+
+void p44_ws2812::setCalibration(const uint8_t *aCalibrationP, uint8_t aBits)
+{
+  if (chainP) {
+    chainP->setCalibration(aCalibrationP, aBits);
+    return;
+  }
+  calibrationP = aCalibrationP;
+  calibrationBits = aBits;
+  // re-encode everything
+  if (encodeBufferP) {
+    for (uint16_t i=0; i<numLeds; i++) encodeLed(i, encodeBufferP+P44_WS2812_BYTES_PER_LED*i);
+  }
+  invalidate();
+}
+
+
+bool p44_ws2812::enableEncodeBuffer()
+{
+  if (chainP) return chainP->enableEncodeBuffer();
+  if (encodeBufferP) return true; // already enabled
+  if (snapshotBufferP) return false; // show() transfers snapshots, not the encoded live buffer
+  if ((encodeBufferP = (uint8_t *)allocBuffer(P44_WS2812_BYTES_PER_LED*numLeds))==NULL) return false;
+  // initial encoding of entire chain
+  for (uint16_t i=0; i<numLeds; i++) encodeLed(i, encodeBufferP+P44_WS2812_BYTES_PER_LED*i);
+  return true;
+}
+
+
+void p44_ws2812::invalidate()
+{
+  if (chainP) {
+    chainP->invalidate();
+  }
+  else {
+    dirtyEnd = numLeds;
+    if (snapshotBufferP) snapshotDirtyEnd = numLeds; // a snapshot already taken must be transferred entirely as well
+    fingerprintValid = false;
+  }
+}
+
+
+bool p44_ws2812::enableThermalModel(uint8_t aRegionShift, uint8_t aLimit, uint8_t aTimeConstantShift)
+{
+  if (chainP) return chainP->enableThermalModel(aRegionShift, aLimit, aTimeConstantShift);
+  if (numLeds==0) return false;
+  if (aRegionShift>15) aRegionShift = 15;
+  if (thermalP && aRegionShift!=thermalShift) {
+    freeBuffer(thermalP, sizeof(ThermalRegion)*(((numLeds-1)>>thermalShift)+1));
+    thermalP = NULL;
+  }
+  uint16_t numRegions = ((numLeds-1)>>aRegionShift)+1;
+  if (!thermalP) {
+    if ((thermalP = (ThermalRegion *)allocBuffer(sizeof(ThermalRegion)*numRegions))==NULL) return false;
+    thermalShift = aRegionShift;
+    // initial duty (cold, no derating)
+    for (uint16_t r=0; r<numRegions; r++) thermalP[r].derating = 255;
+    for (uint16_t i=0; i<numLeds; i++) {
+      RGBPixel *pixP = &(pixelBufferP[i]);
+      thermalP[i>>thermalShift].dutySum += pwmTable[pixP->red]+pwmTable[pixP->green]+pwmTable[pixP->blue];
+    }
+  }
+  thermalLimit = aLimit;
+  thermalTau = aTimeConstantShift;
+  return true;
+}
+
+
+uint8_t p44_ws2812::getDerating(uint16_t aRegion)
+{
+  if (chainP) return chainP->getDerating(aRegion);
+  if (!thermalP || aRegion>(numLeds-1)>>thermalShift) return 255;
+  return thermalP[aRegion].derating;
+}
+
+
+uint8_t p44_ws2812::getHeat(uint16_t aRegion)
+{
+  if (chainP) return chainP->getHeat(aRegion);
+  if (!thermalP || aRegion>(numLeds-1)>>thermalShift) return 0;
+  return thermalP[aRegion].heat>>8;
+}
+
+
+void p44_ws2812::updateThermalModel()
+{
+  uint16_t numRegions = ((numLeds-1)>>thermalShift)+1;
+  uint16_t regionSize = 1<<thermalShift;
+  for (uint16_t r=0; r<numRegions; r++) {
+    ThermalRegion &tr = thermalP[r];
+    uint16_t start = r<<thermalShift;
+    uint16_t n = numLeds-start<regionSize ? numLeds-start : regionSize;
+    // exponential moving average of the mean duty per channel
+    int32_t duty = (tr.dutySum<<8)/(3*n);
+    tr.heat += (duty-(int32_t)tr.heat)>>thermalTau;
+    // derate to bring the long term mean duty down to the limit
+    uint16_t limit = thermalLimit<<8;
+    uint8_t derating = tr.heat>limit ? ((uint32_t)limit*255)/tr.heat : 255;
+    // apply only significant changes, as they require re-encoding the region
+    int16_t delta = (int16_t)derating-tr.derating;
+    if (delta==0 || (derating<255 && delta>-2 && delta<2)) continue;
+    tr.derating = derating;
+    if (encodeBufferP) {
+      for (uint16_t i=start; i<start+n; i++) encodeLed(i, encodeBufferP+P44_WS2812_BYTES_PER_LED*i);
+    }
+    // region must be transferred, even if pixels did not change
+    if (start+n>dirtyEnd) dirtyEnd = start+n;
+    if (start+n>snapshotDirtyEnd) snapshotDirtyEnd = start+n;
+    fingerprintValid = false;
+  }
+}
+
+
+bool p44_ws2812::enableFrameStats(uint32_t aTargetIntervalMicros)
+{
+  if (chainP) return chainP->enableFrameStats(aTargetIntervalMicros);
+  if (!frameStatsP) {
+    if ((frameStatsP = (FrameStats *)allocBuffer(sizeof(FrameStats)))==NULL) return false;
+  }
+  resetFrameStats();
+  frameStatsP->targetInterval = aTargetIntervalMicros;
+  return true;
+}
+
+
+const p44_ws2812::FrameStats *p44_ws2812::getFrameStats()
+{
+  if (chainP) return chainP->getFrameStats();
+  return frameStatsP;
+}
+
+
+void p44_ws2812::resetFrameStats()
+{
+  if (chainP) {
+    chainP->resetFrameStats();
+    return;
+  }
+  if (!frameStatsP) return;
+  uint32_t target = frameStatsP->targetInterval;
+  memset(frameStatsP, 0, sizeof(FrameStats));
+  frameStatsP->targetInterval = target;
+}
+
+
+void p44_ws2812::printFrameStats(Print &aOut)
+{
+  const FrameStats *fsP = getFrameStats();
+  if (!fsP) return;
+  aOut.print("frames: "); aOut.print(fsP->frames);
+  aOut.print(", interval min/max: "); aOut.print(fsP->minInterval);
+  aOut.print("/"); aOut.print(fsP->maxInterval);
+  aOut.print(" uS, target: "); aOut.print(fsP->targetInterval); aOut.println(" uS");
+  uint32_t limit = 16;
+  for (uint8_t b=0; b<jitterBuckets; b++, limit <<= 1) {
+    aOut.print(b<jitterBuckets-1 ? "  jitter < " : "  jitter >= ");
+    aOut.print(b<jitterBuckets-1 ? limit : limit>>1);
+    aOut.print(" uS: ");
+    aOut.println(fsP->jitter[b]);
+  }
+}
+
+
+uint32_t p44_ws2812::getFingerprint(bool aUseHardware)
+{
+  if (chainP) return chainP->getFingerprint(aUseHardware);
+  // Note: buffer size is rounded up to words by allocBuffer(), padding is always zero
+  return crc32(pixelBufferP, (sizeof(RGBPixel)*numLeds+3)/4, aUseHardware);
+}
+
+
+void p44_ws2812::setSkipUnchanged(bool aSkipUnchanged)
+{
+  if (chainP) {
+    chainP->setSkipUnchanged(aSkipUnchanged);
+    return;
+  }
+  skipUnchanged = aSkipUnchanged;
+  fingerprintValid = false;
+}
+
+
+uint32_t p44_ws2812::crc32(const void *aBufferP, size_t aNumWords, bool aUseHardware)
+{
+  const uint32_t *wordP = (const uint32_t *)aBufferP;
+  #ifdef STM32F10X_MD
+  if (aUseHardware) {
+    // STM32 CRC unit processes a word per 4 cycles
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+    CRC->CR = CRC_CR_RESET;
+    while (aNumWords-->0) CRC->DR = *wordP++;
+    return CRC->DR;
+  }
+  #endif
+  // software, same algorithm as the STM32 CRC unit, 4 bits at a time
+  static const uint32_t crcNibbleTable[16] = {
+    0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+    0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+  };
+  uint32_t crc = 0xFFFFFFFF;
+  while (aNumWords-->0) {
+    crc ^= *wordP++;
+    for (uint8_t i=0; i<8; i++) crc = (crc<<4) ^ crcNibbleTable[crc>>28];
+  }
+  return crc;
+}
+
+
+void p44_ws2812::markDirty(uint16_t aLedIndex)
+{
+  // dirty range is tracked in the chain
+  p44_ws2812 *c = chainP ? chainP : this;
+  aLedIndex += firstLed;
+  if (aLedIndex>=c->dirtyEnd) c->dirtyEnd = aLedIndex+1;
+  // re-encode only this LED
+  if (c->encodeBufferP) c->encodeLed(aLedIndex, c->encodeBufferP+P44_WS2812_BYTES_PER_LED*aLedIndex);
+}
+
+
+void p44_ws2812::setLayout(const LayoutRun *aRunsP, uint16_t aNumRuns)
+{
+  layoutRunsP = aRunsP;
+  numLayoutRuns = aRunsP ? aNumRuns : 0;
+  cachedRun = 0;
+  cachedRunStart = 0;
+}
+
+
+bool p44_ws2812::useConfig(const uint8_t *aConfigP, size_t aConfigSize)
+{
+  const ConfigHeader *hdrP = (const ConfigHeader *)aConfigP;
+  // validate
+  if (aConfigSize<sizeof(ConfigHeader) || ((uintptr_t)aConfigP & 3)!=0) return false;
+  if (hdrP->magic!=P44_WS2812_CONFIG_MAGIC || hdrP->version!=P44_WS2812_CONFIG_VERSION) return false;
+  if (hdrP->numLeds!=numLeds || hdrP->ledsPerRow==0) return false;
+  if (hdrP->numRuns>0) {
+    if ((hdrP->runsOffset & 1)!=0 || hdrP->runsOffset>aConfigSize || (aConfigSize-hdrP->runsOffset)/sizeof(LayoutRun)<hdrP->numRuns) return false;
+    // first and last LED of every run must be within the pixel buffer
+    const LayoutRun *runP = (const LayoutRun *)(aConfigP+hdrP->runsOffset);
+    for (uint16_t r=0; r<hdrP->numRuns; r++, runP++) {
+      int32_t last = runP->start+(int32_t)runP->stride*(runP->length-1);
+      if (runP->length==0 || runP->start>=numLeds || last<0 || last>=numLeds) return false;
+    }
+  }
+  size_t calSize = 0;
+  if (hdrP->calibrationBits) {
+    if (chainP) return false; // calibration is per chain
+    if (hdrP->calibrationBits!=4 && hdrP->calibrationBits!=8) return false;
+    calSize = (size_t)numLeds*(hdrP->calibrationBits==4 ? 2 : 3);
+    if (hdrP->calibrationOffset>aConfigSize || aConfigSize-hdrP->calibrationOffset<calSize) return false;
+  }
+  // use in place
+  ledsPerRow = hdrP->ledsPerRow;
+  xReversed = (hdrP->flags & 0x01)!=0;
+  alternating = (hdrP->flags & 0x02)!=0;
+  setLayout(hdrP->numRuns>0 ? (const LayoutRun *)(aConfigP+hdrP->runsOffset) : NULL, hdrP->numRuns);
+  if (!chainP) setCalibration(calSize>0 ? aConfigP+hdrP->calibrationOffset : NULL, hdrP->calibrationBits);
+  return true;
+}
+
+
+size_t p44_ws2812::buildConfig(
+  uint8_t *aBufferP, size_t aBufferSize,
+  uint16_t aNumLeds, uint16_t aLedsPerRow, bool aXReversed, bool aAlternating,
+  const LayoutRun *aRunsP, uint16_t aNumRuns,
+  const uint8_t *aCalibrationP, uint8_t aCalibrationBits
+) {
+  if (!aRunsP) aNumRuns = 0;
+  size_t runsSize = aNumRuns*sizeof(LayoutRun);
+  size_t calSize = aCalibrationP ? (size_t)aNumLeds*(aCalibrationBits==4 ? 2 : 3) : 0;
+  size_t size = sizeof(ConfigHeader)+runsSize+calSize;
+  if (size>aBufferSize) return 0;
+  ConfigHeader *hdrP = (ConfigHeader *)aBufferP;
+  memset(hdrP, 0, sizeof(ConfigHeader));
+  hdrP->magic = P44_WS2812_CONFIG_MAGIC;
+  hdrP->version = P44_WS2812_CONFIG_VERSION;
+  hdrP->numLeds = aNumLeds;
+  hdrP->ledsPerRow = aLedsPerRow ? aLedsPerRow : aNumLeds;
+  hdrP->flags = (aXReversed ? 0x01 : 0) | (aAlternating ? 0x02 : 0);
+  hdrP->numRuns = aNumRuns;
+  hdrP->runsOffset = sizeof(ConfigHeader);
+  if (runsSize>0) memcpy(aBufferP+hdrP->runsOffset, aRunsP, runsSize);
+  if (calSize>0) {
+    hdrP->calibrationBits = aCalibrationBits==4 ? 4 : 8;
+    hdrP->calibrationOffset = hdrP->runsOffset+runsSize;
+    memcpy(aBufferP+hdrP->calibrationOffset, aCalibrationP, calSize);
+  }
+  return size;
+}
+
+
+uint16_t p44_ws2812::compileLayout(const uint16_t *aIndexTableP, uint16_t aNumEntries, LayoutRun *aRunsP, uint16_t aMaxRuns)
+{
+  uint16_t numRuns = 0;
+  uint16_t i = 0;
+  while (i<aNumEntries) {
+    if (numRuns>=aMaxRuns) return 0; // not enough room
+    LayoutRun &run = aRunsP[numRuns++];
+    run.start = aIndexTableP[i];
+    run.stride = i+1<aNumEntries ? (int16_t)(aIndexTableP[i+1]-aIndexTableP[i]) : 1;
+    run.length = 1;
+    // extend as long as the stride remains the same
+    while (i+run.length<aNumEntries && (int16_t)(aIndexTableP[i+run.length]-aIndexTableP[i+run.length-1])==run.stride) {
+      run.length++;
+    }
+    i += run.length;
+  }
+  return numRuns;
+}
+
+
+uint16_t p44_ws2812::ledNumberFromIndex(uint16_t aLedIndex)
+{
+  if (layoutRunsP) {
+    // search all runs
+    uint16_t runStart = 0;
+    for (uint16_t r=0; r<numLayoutRuns; r++) {
+      const LayoutRun &run = layoutRunsP[r];
+      int32_t o = (int32_t)aLedIndex-run.start;
+      if (run.stride==0) {
+        if (o==0) return runStart;
+      }
+      else if (o%run.stride==0 && o/run.stride>=0 && o/run.stride<run.length) {
+        return runStart+o/run.stride;
+      }
+      runStart += run.length;
+    }
+    return 0xFFFF;
+  }
+  uint16_t y = aLedIndex / ledsPerRow;
+  uint16_t x = aLedIndex % ledsPerRow;
+  return y*ledsPerRow + (rowReversed(y) ? ledsPerRow-1-x : x);
+}
+
+
+uint16_t p44_ws2812::ledIndexFromRuns(uint16_t aLedNumber)
+{
+  uint16_t idx;
+  int16_t stride;
+  if (getSpan(aLedNumber, idx, stride)==0) return 0xFFFF;
+  return idx;
+}
+
+
+uint16_t p44_ws2812::getSpan(uint16_t aLedNumber, uint16_t &aLedIndex, int16_t &aStride)
+{
+  if (layoutRunsP) {
+    // search runs, starting from the cached one if possible
+    if (aLedNumber<cachedRunStart) {
+      cachedRun = 0;
+      cachedRunStart = 0;
+    }
+    while (cachedRun<numLayoutRuns) {
+      const LayoutRun &run = layoutRunsP[cachedRun];
+      uint16_t o = aLedNumber-cachedRunStart;
+      if (o<run.length) {
+        aStride = run.stride;
+        uint16_t n = run.length-o;
+        int32_t i = run.start+(int32_t)o*run.stride;
+        // clip the span to the part within the buffer, or to the part before the run enters it
+        uint32_t k = n;
+        if (i>=0 && i<numLeds) {
+          aLedIndex = i;
+          if (run.stride>0) k = (numLeds-1-i)/run.stride+1;
+          else if (run.stride<0) k = i/(-run.stride)+1;
+        }
+        else {
+          aLedIndex = 0xFFFF;
+          if (run.stride>0 && i<0) k = (-i+run.stride-1)/run.stride;
+          else if (run.stride<0 && i>=numLeds) k = (i-numLeds-run.stride)/(-run.stride);
+        }
+        return k<n ? k : n;
+      }
+      cachedRunStart += run.length;
+      cachedRun++;
+    }
+    return 0;
+  }
+  // regular layout: spans are (the rest of) rows
+  uint16_t y = aLedNumber / ledsPerRow;
+  uint16_t x = aLedNumber % ledsPerRow;
+  uint16_t rowStart = y*ledsPerRow;
+  if (rowStart>=numLeds) return 0; // beyond last row
+  if (rowReversed(y)) {
+    aStride = -1;
+    aLedIndex = rowStart+ledsPerRow-1-x;
+    if (aLedIndex>=numLeds) {
+      // partial last row, leading part of span is beyond end of chain
+      uint16_t beyond = aLedIndex-numLeds+1;
+      aLedIndex = 0xFFFF;
+      return beyond;
+    }
+    return aLedIndex-rowStart+1;
+  }
+  aStride = 1;
+  aLedIndex = rowStart+x;
+  if (aLedIndex>=numLeds) return 0; // partial last row, beyond end of chain
+  return (rowStart+ledsPerRow<=numLeds ? ledsPerRow : numLeds-rowStart)-x;
+}
+
+
+void p44_ws2812::fill(uint16_t aFirstLed, uint16_t aNumLeds, byte aRed, byte aGreen, byte aBlue)
+{
+  while (aNumLeds>0) {
+    uint16_t idx;
+    int16_t stride;
+    uint16_t n = getSpan(aFirstLed, idx, stride);
+    if (n==0) break;
+    if (n>aNumLeds) n = aNumLeds;
+    if (idx!=0xFFFF) {
+      for (uint16_t i=0; i<n; i++, idx+=stride) storeColor(idx, aRed, aGreen, aBlue);
+    }
+    aFirstLed += n;
+    aNumLeds -= n;
+  }
+}
+
+
+template<class G> void p44_ws2812::generate(uint16_t aFirstLed, uint16_t aNumLeds, G &aGenerator)
+{
+  RGBColor c;
+  while (aNumLeds>0) {
+    uint16_t idx;
+    int16_t stride;
+    uint16_t n = getSpan(aFirstLed, idx, stride);
+    if (n==0) break;
+    if (n>aNumLeds) n = aNumLeds;
+    if (idx==0xFFFF) {
+      aGenerator.skip(n);
+    }
+    else {
+      for (uint16_t i=0; i<n; i++, idx+=stride) {
+        aGenerator.next(c);
+        storeColor(idx, c.red, c.green, c.blue);
+      }
+    }
+    aFirstLed += n;
+    aNumLeds -= n;
+  }
+}
+
+
+// linear color ramp with 16.16 fixed point increments
+class p44_ws2812_gradient_generator {
+  int32_t r, g, b;
+  int32_t dr, dg, db;
+public:
+  p44_ws2812_gradient_generator(const p44_ws2812::RGBColor &aFrom, const p44_ws2812::RGBColor &aTo, uint16_t aSteps) {
+    r = ((int32_t)aFrom.red<<16)+0x8000;
+    g = ((int32_t)aFrom.green<<16)+0x8000;
+    b = ((int32_t)aFrom.blue<<16)+0x8000;
+    dr = aSteps ? (((int32_t)aTo.red-aFrom.red)*65536)/aSteps : 0;
+    dg = aSteps ? (((int32_t)aTo.green-aFrom.green)*65536)/aSteps : 0;
+    db = aSteps ? (((int32_t)aTo.blue-aFrom.blue)*65536)/aSteps : 0;
+  };
+  inline void next(p44_ws2812::RGBColor &aColor) {
+    aColor.red = r>>16; aColor.green = g>>16; aColor.blue = b>>16;
+    r += dr; g += dg; b += db;
+  };
+  inline void skip(uint16_t aN) { r += dr*aN; g += dg*aN; b += db*aN; };
+};
+
+
+void p44_ws2812::fillGradient(uint16_t aFirstLed, uint16_t aNumLeds, const RGBColor *aColorsP, uint8_t aNumColors)
+{
+  if (aNumColors==0 || aNumLeds==0) return;
+  if (aNumColors==1 || aNumLeds==1) {
+    fill(aFirstLed, aNumLeds, aColorsP[0].red, aColorsP[0].green, aColorsP[0].blue);
+    return;
+  }
+  // stop k is at LED k*(aNumLeds-1)/(aNumColors-1), the sections in between are stepped from one stop to the next
+  uint16_t pos = 0;
+  for (uint8_t k=1; k<aNumColors; k++) {
+    uint16_t next = (uint32_t)k*(aNumLeds-1)/(aNumColors-1);
+    p44_ws2812_gradient_generator gen(aColorsP[k-1], aColorsP[k], next-pos);
+    generate(aFirstLed+pos, next-pos, gen);
+    pos = next;
+  }
+  // last stop
+  const RGBColor &last = aColorsP[aNumColors-1];
+  fill(aFirstLed+pos, 1, last.red, last.green, last.blue);
+}
+
+
+void p44_ws2812::fillGradient(uint16_t aFirstLed, uint16_t aNumLeds, const RGBColor &aStart, const RGBColor &aEnd)
+{
+  RGBColor stops[2] = { aStart, aEnd };
+  fillGradient(aFirstLed, aNumLeds, stops, 2);
+}
+
+
+// palette interpolation, 4 bits palette index and 8 bits fraction from a 16 bit position
+class p44_ws2812_palette_generator {
+  const p44_ws2812::RGBColor *paletteP;
+  uint16_t pos;
+  uint16_t stride;
+public:
+  p44_ws2812_palette_generator(const p44_ws2812::RGBColor *aPaletteP, uint16_t aOffset, uint16_t aStride) : paletteP(aPaletteP), pos(aOffset), stride(aStride) {};
+  inline void next(p44_ws2812::RGBColor &aColor) {
+    const p44_ws2812::RGBColor &c0 = paletteP[pos>>12];
+    const p44_ws2812::RGBColor &c1 = paletteP[((pos>>12)+1) & 0x0F];
+    int16_t f = (pos>>4) & 0xFF;
+    aColor.red = c0.red+(((c1.red-c0.red)*f)>>8);
+    aColor.green = c0.green+(((c1.green-c0.green)*f)>>8);
+    aColor.blue = c0.blue+(((c1.blue-c0.blue)*f)>>8);
+    pos += stride;
+  };
+  inline void skip(uint16_t aN) { pos += stride*aN; };
+};
+
+
+void p44_ws2812::fillPalette(const RGBColor *aPaletteP, uint16_t aOffset, uint16_t aStride, uint16_t aFirstLed, uint16_t aNumLeds)
+{
+  p44_ws2812_palette_generator gen(aPaletteP, aOffset, aStride);
+  generate(aFirstLed, aNumLeds, gen);
+}
+
+
+// colors of a sprite run, from the palette or RGB
+class p44_ws2812_sprite_run_generator {
+  const uint8_t *dataP;
+  const uint8_t *paletteP;
+  bool literal;
+public:
+  p44_ws2812_sprite_run_generator(const uint8_t *aDataP, const uint8_t *aPaletteP, bool aLiteral) :
+    dataP(aDataP), paletteP(aPaletteP), literal(aLiteral) {};
+  void next(p44_ws2812::RGBColor &aColor)
+  {
+    const uint8_t *cP = paletteP ? paletteP+3*(*dataP) : dataP;
+    aColor.red = cP[0];
+    aColor.green = cP[1];
+    aColor.blue = cP[2];
+    if (literal) dataP += paletteP ? 1 : 3;
+  };
+  void skip(uint16_t aNum) { if (literal) dataP += aNum*(paletteP ? 1 : 3); };
+};
+
+
+void p44_ws2812::blit(const uint8_t *aSpriteP, int16_t aX, int16_t aY)
+{
+  uint8_t w = aSpriteP[0];
+  uint8_t h = aSpriteP[1];
+  uint8_t numColors = aSpriteP[2];
+  const uint8_t *paletteP = numColors>0 ? aSpriteP+3 : NULL;
+  uint8_t colorSize = paletteP ? 1 : 3;
+  const uint8_t *p = aSpriteP+3+3*numColors;
+  int16_t numRows = (numLeds+ledsPerRow-1)/ledsPerRow;
+  for (int16_t sy=0; sy<h; sy++) {
+    int16_t y = aY+sy;
+    bool visible = y>=0 && y<numRows;
+    int16_t sx = 0;
+    while (sx<w) {
+      uint8_t type = *p>>6;
+      int16_t runLen = (*p++ & 0x3F)+1;
+      if (type>2) return; // invalid sprite
+      const uint8_t *dataP = p;
+      if (type==1) p += colorSize;
+      else if (type==2) p += runLen*colorSize;
+      if (visible && type!=0) {
+        // clip run horizontally
+        int16_t x = aX+sx;
+        int16_t len = runLen;
+        p44_ws2812_sprite_run_generator gen(dataP, paletteP, type==2);
+        if (x<0) {
+          if (x+len>0) gen.skip(-x);
+          len += x;
+          x = 0;
+        }
+        if (x+len>ledsPerRow) len = ledsPerRow-x;
+        if (len>0) generate(y*ledsPerRow+x, len, gen);
+      }
+      sx += runLen;
+    }
+  }
+}
+
+
+const uint8_t *p44_ws2812::getSprite(const uint8_t *aAtlasP, uint8_t aSpriteNo)
+{
+  if (aSpriteNo>=aAtlasP[0]) return NULL;
+  const uint8_t *offsP = aAtlasP+1+2*aSpriteNo;
+  return aAtlasP+(offsP[0] | (offsP[1]<<8));
+}
+
+
+static bool sameColor(const p44_ws2812::RGBColor &aA, const p44_ws2812::RGBColor &aB)
+{
+  return aA.red==aB.red && aA.green==aB.green && aA.blue==aB.blue;
+}
+
+
+size_t p44_ws2812::compressSprite(
+  uint8_t *aBufferP, size_t aBufferSize,
+  const RGBColor *aPixelsP, uint8_t aWidth, uint8_t aHeight,
+  const RGBColor *aTransparentP, const RGBColor *aPaletteP, uint8_t aNumColors
+) {
+  if (!aPaletteP) aNumColors = 0;
+  size_t colorSize = aNumColors>0 ? 1 : 3;
+  size_t size = 3+3*aNumColors;
+  if (size>aBufferSize) return 0;
+  aBufferP[0] = aWidth;
+  aBufferP[1] = aHeight;
+  aBufferP[2] = aNumColors;
+  for (uint8_t i=0; i<aNumColors; i++) {
+    aBufferP[3+3*i] = aPaletteP[i].red;
+    aBufferP[4+3*i] = aPaletteP[i].green;
+    aBufferP[5+3*i] = aPaletteP[i].blue;
+  }
+  for (uint8_t y=0; y<aHeight; y++) {
+    const RGBColor *rowP = aPixelsP+y*aWidth;
+    uint8_t x = 0;
+    while (x<aWidth) {
+      // determine run
+      uint8_t type;
+      uint8_t len = 1;
+      if (aTransparentP && sameColor(rowP[x], *aTransparentP)) {
+        type = 0;
+        while (x+len<aWidth && len<64 && sameColor(rowP[x+len], *aTransparentP)) len++;
+      }
+      else if (x+1<aWidth && sameColor(rowP[x+1], rowP[x])) {
+        type = 1;
+        while (x+len<aWidth && len<64 && sameColor(rowP[x+len], rowP[x])) len++;
+      }
+      else {
+        // literal until transparent pixel or start of a solid run
+        type = 2;
+        while (
+          x+len<aWidth && len<64 &&
+          !(aTransparentP && sameColor(rowP[x+len], *aTransparentP)) &&
+          !(x+len+1<aWidth && sameColor(rowP[x+len+1], rowP[x+len]))
+        ) len++;
+      }
+      size_t runSize = 1+(type==0 ? 0 : (type==1 ? 1 : len)*colorSize);
+      if (size+runSize>aBufferSize) return 0;
+      aBufferP[size++] = (type<<6) | (len-1);
+      for (uint8_t i=0; i<(type==0 ? 0 : (type==1 ? 1 : len)); i++) {
+        const RGBColor &c = rowP[x+i];
+        if (aNumColors>0) {
+          uint8_t ci = 0;
+          while (ci<aNumColors && !sameColor(aPaletteP[ci], c)) ci++;
+          if (ci>=aNumColors) return 0; // not in palette
+          aBufferP[size++] = ci;
+        }
+        else {
+          aBufferP[size++] = c.red;
+          aBufferP[size++] = c.green;
+          aBufferP[size++] = c.blue;
+        }
+      }
+      x += len;
+    }
+  }
+  return size;
+}
+
+
+size_t p44_ws2812::buildAtlas(uint8_t *aBufferP, size_t aBufferSize, const uint8_t * const *aSpritesP, const size_t *aSizesP, uint8_t aNumSprites)
+{
+  size_t size = 1+2*aNumSprites;
+  if (size>aBufferSize) return 0;
+  aBufferP[0] = aNumSprites;
+  for (uint8_t i=0; i<aNumSprites; i++) {
+    if (size>0xFFFF || size+aSizesP[i]>aBufferSize) return 0;
+    aBufferP[1+2*i] = size & 0xFF;
+    aBufferP[2+2*i] = size>>8;
+    memcpy(aBufferP+size, aSpritesP[i], aSizesP[i]);
+    size += aSizesP[i];
+  }
+  return size;
+}
+
+
+bool p44_ws2812::blur(uint8_t aRadius, uint8_t aPasses)
+{
+  if (aRadius==0 || aPasses==0 || numLeds==0) return true;
+  if (aRadius>maxBlurRadius) aRadius = maxBlurRadius;
+  uint16_t numRows = (numLeds+ledsPerRow-1)/ledsPerRow;
+  uint16_t lineLen = ledsPerRow>numRows ? ledsPerRow : numRows;
+  if (blurScratchLen<lineLen) {
+    freeBuffer(blurScratchP, 3*sizeof(uint16_t)*blurScratchLen);
+    blurScratchLen = 0;
+    if ((blurScratchP = (uint16_t *)allocBuffer(3*sizeof(uint16_t)*lineLen))==NULL) return false;
+    blurScratchLen = lineLen;
+  }
+  for (uint16_t y=0; y<numRows; y++) blurLine(false, y, ledsPerRow, aRadius, aPasses);
+  if (numRows>1) {
+    for (uint16_t x=0; x<ledsPerRow; x++) blurLine(true, x, numRows, aRadius, aPasses);
+  }
+  return true;
+}
+
+
+// running sum box filter, in place
+static void boxFilter(uint16_t *aValuesP, uint16_t aNumValues, uint8_t aRadius)
+{
+  // the window sum needs the original values of the last aRadius+1 positions, which are already overwritten
+  uint16_t ring[p44_ws2812::maxBlurRadius+1];
+  uint8_t ringPos = 0;
+  uint32_t recip = (65536+2*aRadius)/(2*aRadius+1); // rounded up
+  uint16_t first = aValuesP[0];
+  uint16_t last = aValuesP[aNumValues-1];
+  // initial window, edges extended
+  uint32_t sum = (uint32_t)(aRadius+1)*first;
+  for (uint16_t i=1; i<=aRadius; i++) sum += i<aNumValues ? aValuesP[i] : last;
+  for (uint16_t i=0; i<aNumValues; i++) {
+    ring[ringPos] = aValuesP[i];
+    aValuesP[i] = (sum*recip)>>16;
+    // slide window
+    uint16_t in = i+aRadius+1;
+    sum += in<aNumValues ? aValuesP[in] : last;
+    if (++ringPos>aRadius) ringPos = 0;
+    sum -= i>=aRadius ? ring[ringPos] : first; // ring[ringPos] is the value at i-aRadius
+  }
+}
+
+
+void p44_ws2812::blurLine(bool aColumn, uint16_t aLine, uint16_t aLength, uint8_t aRadius, uint8_t aPasses)
+{
+  uint16_t *rP = blurScratchP;
+  uint16_t *gP = rP+blurScratchLen;
+  uint16_t *bP = gP+blurScratchLen;
+  // read LEDs present in the line, 5 bit to 12 bit
+  uint16_t n = 0;
+  for (uint16_t p=0; p<aLength; p++) {
+    uint16_t idx = aColumn ? ledIndexFromXY(aLine, p) : ledIndexFromXY(p, aLine);
+    if (idx>=numLeds) continue;
+    RGBPixel *pixP = &(pixelBufferP[idx]);
+    rP[n] = pixP->red<<7;
+    gP[n] = pixP->green<<7;
+    bP[n] = pixP->blue<<7;
+    n++;
+  }
+  if (n<2) return;
+  for (uint8_t i=0; i<aPasses; i++) {
+    boxFilter(rP, n, aRadius);
+    boxFilter(gP, n, aRadius);
+    boxFilter(bP, n, aRadius);
+  }
+  // write back
+  n = 0;
+  for (uint16_t p=0; p<aLength; p++) {
+    uint16_t idx = aColumn ? ledIndexFromXY(aLine, p) : ledIndexFromXY(p, aLine);
+    if (idx>=numLeds) continue;
+    storePixel(idx, rP[n]>>4, gP[n]>>4, bP[n]>>4);
+    n++;
+  }
+}
+
+
+uint16_t p44_ws2812::ledIndexFromXY(uint16_t aX, uint16_t aY)
+{
+  if (layoutRunsP) return ledIndexFromRuns(aY*ledsPerRow+aX);
+  uint16_t ledindex = aY*ledsPerRow;
+  if (rowReversed(aY)) {
+    ledindex += (ledsPerRow-1-aX);
+  }
+  else {
+    ledindex += aX;
+  }
+  return ledindex;
+}
+
+
+void p44_ws2812::setColor(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue)
+{
+  int y = aLedNumber / ledsPerRow;
+  int x = aLedNumber % ledsPerRow;
+  setColorXY(x, y, aRed, aGreen, aBlue);
+}
+
+
+void p44_ws2812::setColorXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue)
+{
+  uint16_t ledindex = ledIndexFromXY(aX,aY);
+  if (ledindex>=numLeds) return;
+  storeColor(ledindex, aRed, aGreen, aBlue);
+}
+
+
+void p44_ws2812::storeColor(uint16_t aLedIndex, byte aRed, byte aGreen, byte aBlue)
+{
+  // apply color correction, if any
+  if ((corrRed & corrGreen & corrBlue)!=255) {
+    aRed = (aRed*(corrRed+1))>>8;
+    aGreen = (aGreen*(corrGreen+1))>>8;
+    aBlue = (aBlue*(corrBlue+1))>>8;
+  }
+  storePixel(aLedIndex, aRed, aGreen, aBlue);
+}
+
+
+void p44_ws2812::storePixel(uint16_t aLedIndex, byte aRed, byte aGreen, byte aBlue)
+{
+  // the snapshot must not pick up parts of the next frame
+  p44_ws2812 *cP = chainP ? chainP : this;
+  if (cP->snapshotCopying) cP->waitSnapshotCopy();
+  RGBPixel *pixP = &(pixelBufferP[aLedIndex]);
+  // maintain duty of the thermal model region
+  ThermalRegion *thermP = chainP ? chainP->thermalP : thermalP;
+  if (thermP) {
+    ThermalRegion &tr = thermP[(firstLed+aLedIndex)>>(chainP ? chainP->thermalShift : thermalShift)];
+    tr.dutySum += pwmTable[aRed>>3]+pwmTable[aGreen>>3]+pwmTable[aBlue>>3];
+    tr.dutySum -= pwmTable[pixP->red]+pwmTable[pixP->green]+pwmTable[pixP->blue];
+  }
+  // linear brightness is stored with 5bit precision only
+  pixP->red = aRed>>3;
+  pixP->green = aGreen>>3;
+  pixP->blue = aBlue>>3;
+  markDirty(aLedIndex);
+}
+
+
+void p44_ws2812::applyUpdates(const Update *aUpdatesP, uint16_t aNumUpdates)
+{
+  // updates are sorted in chunks via an index array on the stack. As chunks are
+  // applied in order, a later update for the same LED still wins across chunks.
+  const uint8_t chunkSize = 64;
+  uint16_t sorted[chunkSize];
+  while (aNumUpdates>0) {
+    uint8_t n = aNumUpdates>chunkSize ? chunkSize : aNumUpdates;
+    // stable insertion sort by LED number (batches are small and often pre-sorted)
+    for (uint8_t i=0; i<n; i++) {
+      uint16_t ledNo = aUpdatesP[i].ledNumber;
+      uint8_t j = i;
+      while (j>0 && aUpdatesP[sorted[j-1]].ledNumber>ledNo) {
+        sorted[j] = sorted[j-1];
+        j--;
+      }
+      sorted[j] = i;
+    }
+    // apply, walking rows incrementally instead of dividing for each LED
+    uint16_t y = 0;
+    uint16_t rowStart = 0;
+    bool reversed = rowReversed(0);
+    for (uint8_t i=0; i<n; i++) {
+      const Update &u = aUpdatesP[sorted[i]];
+      // skip all but the last of duplicates
+      if (i+1<n && aUpdatesP[sorted[i+1]].ledNumber==u.ledNumber) continue;
+      if (layoutRunsP) {
+        // run lookup is cached, so it's efficient for sorted updates
+        uint16_t ledindex = ledIndexFromRuns(u.ledNumber);
+        if (ledindex<numLeds) storeColor(ledindex, u.red, u.green, u.blue);
+        continue;
+      }
+      if (u.ledNumber-rowStart>=ledsPerRow) {
+        // next row(s)
+        if (u.ledNumber-rowStart>=2*ledsPerRow) {
+          y = u.ledNumber / ledsPerRow;
+          rowStart = y*ledsPerRow;
+        }
+        else {
+          y++;
+          rowStart += ledsPerRow;
+        }
+        reversed = rowReversed(y);
+        if (rowStart>=numLeds) break; // sorted, so all others are beyond the last row as well
+      }
+      uint16_t x = u.ledNumber-rowStart;
+      uint16_t ledindex = rowStart + (reversed ? ledsPerRow-1-x : x);
+      if (ledindex<numLeds) storeColor(ledindex, u.red, u.green, u.blue);
+    }
+    aUpdatesP += n;
+    aNumUpdates -= n;
+  }
+}
+
+
+void p44_ws2812::setColorDimmed(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aBrightness)
+{
+  int y = aLedNumber / ledsPerRow;
+  int x = aLedNumber % ledsPerRow;
+  setColorDimmedXY(x, y, aRed, aGreen, aBlue, aBrightness);
+}
+
+
+void p44_ws2812::setColorDimmedXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue, byte aBrightness)
+{
+  setColorXY(aX, aY, (aRed*aBrightness)>>8, (aGreen*aBrightness)>>8, (aBlue*aBrightness)>>8);
+}
+
+
+p44_ws2812::Range p44_ws2812::segment(uint16_t aFirstLedIndex, uint16_t aNumLeds)
+{
+  if (aFirstLedIndex>numLeds) aFirstLedIndex = numLeds;
+  if (aNumLeds>numLeds-aFirstLedIndex) aNumLeds = numLeds-aFirstLedIndex;
+  return Range(iterator(this, aFirstLedIndex, 1), iterator(this, aFirstLedIndex+aNumLeds, 1));
+}
+
+
+p44_ws2812::Range p44_ws2812::row(uint16_t aY)
+{
+  uint16_t x = 0;
+  while (x<ledsPerRow) {
+    uint16_t idx;
+    int16_t stride;
+    uint16_t n = getSpan(aY*ledsPerRow+x, idx, stride);
+    if (n==0) break;
+    if (idx!=0xFFFF) {
+      // first part of the row actually present in the buffer
+      if (n>ledsPerRow-x) n = ledsPerRow-x;
+      iterator i(this, idx, stride);
+      return Range(i, i+n);
+    }
+    x += n;
+  }
+  return Range(iterator(this, 0, 1), iterator(this, 0, 1)); // empty
+}
+
+
+p44_ws2812::Range p44_ws2812::span(uint16_t aLedNumber)
+{
+  uint16_t idx;
+  int16_t stride;
+  uint16_t n = getSpan(aLedNumber, idx, stride);
+  if (n==0 || idx==0xFFFF) return Range(iterator(this, 0, 1), iterator(this, 0, 1)); // empty
+  iterator i(this, idx, stride);
+  return Range(i, i+n);
+}
+
+
+void p44_ws2812::getPixel(uint16_t aLedIndex, RGBColor &aColor)
+{
+  if (aLedIndex>=numLeds) return;
+  RGBPixel *pixP = &(pixelBufferP[aLedIndex]);
+  aColor.red = pixP->red<<3;
+  aColor.green = pixP->green<<3;
+  aColor.blue = pixP->blue<<3;
+}
+
+
+void p44_ws2812::setPixel(uint16_t aLedIndex, const RGBColor &aColor)
+{
+  if (aLedIndex>=numLeds) return;
+  storePixel(aLedIndex, aColor.red, aColor.green, aColor.blue);
+}
+
+
+void p44_ws2812::getColor(uint16_t aLedNumber, byte &aRed, byte &aGreen, byte &aBlue)
+{
+  int y = aLedNumber / ledsPerRow;
+  int x = aLedNumber % ledsPerRow;
+  getColorXY(x, y, aRed, aGreen, aBlue);
+}
+
+
+void p44_ws2812::getColorXY(uint16_t aX, uint16_t aY, byte &aRed, byte &aGreen, byte &aBlue)
+{
+  uint16_t ledindex = ledIndexFromXY(aX,aY);
+  if (ledindex>=numLeds) return;
+  RGBPixel *pixP = &(pixelBufferP[ledindex]);
+  // linear brightness is stored with 5bit precision only
+  aRed = pixP->red<<3;
+  aGreen = pixP->green<<3;
+  aBlue = pixP->blue<<3;
+}
+
+
+
+
+bool p44_ws2812::getOutputColorXY(uint16_t aX, uint16_t aY, RGBColor &aColor)
+{
+  uint16_t ledindex = ledIndexFromXY(aX,aY);
+  if (ledindex>=numLeds) return false;
+  p44_ws2812 *c = chainP ? chainP : this;
+  uint8_t enc[P44_WS2812_BYTES_PER_LED];
+  if (c->snapshotBufferP) {
+    // double buffered: show() transfers the snapshot, not the pixel buffer
+    c->waitSnapshotCopy();
+    RGBPixel *pixP = &(c->snapshotBufferP[firstLed+ledindex]);
+    c->encodeColor(firstLed+ledindex, pixP->red, pixP->green, pixP->blue, enc);
+  }
+  else {
+    c->encodeLed(firstLed+ledindex, enc);
+  }
+  // decode G-R-B, one SPI byte per bit
+  uint8_t v[3] = { 0, 0, 0 };
+  for (uint8_t i=0; i<P44_WS2812_BYTES_PER_LED; i++) {
+    v[i/8] = (v[i/8]<<1) | (enc[i]==0x7E ? 1 : 0);
+  }
+  aColor.green = v[0];
+  aColor.red = v[1];
+  aColor.blue = v[2];
+  return true;
+}
+
+
+
+
+// Frame synchronisation
+// =====================
+
+#define P44_WS2812_SYNC_MAGIC 0x53343450 // "P44S"
+
+p44_ws2812_sync *p44_ws2812_sync::pulseSyncP = NULL;
+
+
+p44_ws2812_sync::p44_ws2812_sync()
+{
+  timeOffset = 0;
+  synced = false;
+  udpPort = 0;
+  pulsePeriod = 0;
+  pulseCount = 0;
+  usPerLed256 = 27*256; // initial estimate, replaced by measurement after first frame
+  resetStats();
+}
+
+
+void p44_ws2812_sync::resetStats()
+{
+  frames = 0;
+  lateFrames = 0;
+  maxSkew = 0;
+  sumSkew = 0;
+}
+
+
+void p44_ws2812_sync::beginUDP(uint16_t aPort)
+{
+  udpPort = aPort;
+  udp.begin(udpPort);
+}
+
+
+void p44_ws2812_sync::beginGPIO(uint16_t aPin, uint32_t aPeriodMicros)
+{
+  pulsePeriod = aPeriodMicros;
+  pulseSyncP = this;
+  pinMode(aPin, INPUT);
+  attachInterrupt(aPin, syncPulseISR, RISING);
+}
+
+
+void p44_ws2812_sync::syncPulseISR()
+{
+  p44_ws2812_sync *s = pulseSyncP;
+  if (!s) return;
+  // the n-th edge marks sync time n*period
+  s->pulseCount++;
+  s->timeOffset = (int32_t)(s->pulseCount*s->pulsePeriod - micros());
+  s->synced = true;
+}
+
+
+void p44_ws2812_sync::sendSync(IPAddress aTarget)
+{
+  if (udpPort==0) return;
+  // master's timebase is its local time
+  synced = true;
+  uint32_t msg[2];
+  msg[0] = P44_WS2812_SYNC_MAGIC;
+  msg[1] = syncTime();
+  udp.beginPacket(aTarget, udpPort);
+  udp.write((const uint8_t *)msg, sizeof(msg));
+  udp.endPacket();
+}
+
+
+void p44_ws2812_sync::process()
+{
+  if (udpPort==0) return;
+  while (udp.parsePacket()>0) {
+    uint32_t msg[2];
+    if (udp.read((uint8_t *)msg, sizeof(msg))==sizeof(msg) && msg[0]==P44_WS2812_SYNC_MAGIC) {
+      int32_t offs = (int32_t)(msg[1]-micros());
+      if (pulsePeriod>0) {
+        // pulses define the phase, the master's time only selects the pulse number (epoch)
+        if (synced) {
+          int32_t diff = offs-timeOffset;
+          int32_t periods = (diff+(diff<0 ? -(int32_t)pulsePeriod : (int32_t)pulsePeriod)/2)/(int32_t)pulsePeriod;
+          if (periods!=0) {
+            __disable_irq();
+            pulseCount += periods;
+            timeOffset += periods*(int32_t)pulsePeriod;
+            __enable_irq();
+          }
+        }
+      }
+      else if (!synced) {
+        timeOffset = offs;
+        synced = true;
+      }
+      else {
+        // Note: network delay only ever makes sync packets late, so a larger offset is a better estimate.
+        // Follow those immediately, but let the offset decay slowly to track clock drift.
+        if (offs>timeOffset)
+          timeOffset = offs;
+        else
+          timeOffset -= (timeOffset-offs+15)>>4;
+      }
+    }
+    udp.flush();
+  }
+}
+
+
+uint32_t p44_ws2812_sync::syncTime()
+{
+  return micros()+timeOffset;
+}
+
+
+int32_t p44_ws2812_sync::showAt(p44_ws2812 &aLeds, uint32_t aPresentationTime)
+{
+  // start early by the transfer time, so end of data (= latch) happens at presentation time
+  // (segments transfer their entire chain)
+  uint32_t transferTime = (usPerLed256*aLeds.getChainNumLeds())>>8;
+  uint32_t startTime = aPresentationTime-transferTime;
+  if ((int32_t)(syncTime()-startTime)>0) {
+    lateFrames++; // too late already
+  }
+  else {
+    while ((int32_t)(syncTime()-startTime)<0);
+  }
+  aLeds.invalidate(); // all nodes must transfer the full chain for the transfer time to be predictable
+  uint32_t t = micros();
+  aLeds.show();
+  uint32_t done = micros();
+  // update transfer time per LED measurement
+  if (aLeds.getChainNumLeds()>0) usPerLed256 = ((done-t)<<8)/aLeds.getChainNumLeds();
+  // statistics
+  int32_t skew = (int32_t)(done+timeOffset-aPresentationTime);
+  uint32_t absSkew = skew<0 ? -skew : skew;
+  frames++;
+  sumSkew += absSkew;
+  if (absSkew>maxSkew) maxSkew = absSkew;
+  return skew;
+}
+
+
+
+// Effect bytecode interpreter
+// ===========================
+
+p44_ws2812_vm::p44_ws2812_vm()
+{
+  codeSize = 0;
+  rxState = 0;
+}
+
+
+bool p44_ws2812_vm::load(const uint8_t *aCodeP, uint16_t aCodeSize)
+{
+  if (aCodeSize>maxCodeSize) return false;
+  // validate before activating, the interpreter does no checks at runtime
+  uint16_t pc = 0;
+  while (true) {
+    if (pc>=aCodeSize) return false; // no end
+    uint8_t op = aCodeP[pc++];
+    if (op==op_end) break;
+    if (op>=numOpcodes || pc>=aCodeSize) return false;
+    uint8_t regs = aCodeP[pc++];
+    if ((regs>>4)>7) return false; // destination must be a valid register
+    if (op!=op_shl && op!=op_shr && (regs & 0x0F)>7) return false; // source must be a valid register
+    if (op==op_ldi) pc += 2;
+  }
+  memcpy(code, aCodeP, pc);
+  codeSize = pc;
+  return true;
+}
+
+
+bool p44_ws2812_vm::receive(Stream &aStream)
+{
+  bool loaded = false;
+  while (aStream.available()>0) {
+    uint8_t b = aStream.read();
+    switch (rxState) {
+      case 0:
+        if (b==0xA5) rxState = 1;
+        break;
+      case 1:
+        rxLen = b;
+        rxCount = 0;
+        rxSum = 0;
+        rxState = rxLen>0 && rxLen<=maxCodeSize ? 2 : 0;
+        break;
+      case 2:
+        rxBuffer[rxCount++] = b;
+        rxSum += b;
+        if (rxCount>=rxLen) rxState = 3;
+        break;
+      case 3:
+        if (b==rxSum && load(rxBuffer, rxLen)) loaded = true;
+        rxState = 0;
+        break;
+    }
+  }
+  return loaded;
+}
+
+
+void p44_ws2812_vm::run(p44_ws2812 &aLeds, uint32_t aTime)
+{
+  if (codeSize==0) return;
+  uint16_t numLeds = aLeds.getNumLeds();
+  uint16_t ledsPerRow = aLeds.getLedsPerRow();
+  uint16_t x = 0;
+  uint16_t y = 0;
+  for (uint16_t i=0; i<numLeds; i++) {
+    int32_t r[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    const uint8_t *pc = code;
+    while (true) {
+      uint8_t op = *pc++;
+      if (op==op_end) break;
+      uint8_t regs = *pc++;
+      int32_t &d = r[regs>>4];
+      int32_t &s = r[regs & 0x07];
+      switch (op) {
+        case op_ldi: d = (int16_t)(pc[0] | (pc[1]<<8)); pc += 2; break;
+        case op_mov: d = s; break;
+        case op_idx: d = i; break;
+        case op_x: d = x; break;
+        case op_y: d = y; break;
+        case op_time: d = aTime; break;
+        case op_num: d = numLeds; break;
+        // programs are uploaded, so arithmetic must wrap around (done unsigned) rather than overflow
+        case op_add: d = (uint32_t)d+(uint32_t)s; break;
+        case op_sub: d = (uint32_t)d-(uint32_t)s; break;
+        case op_mul: d = (uint32_t)d*(uint32_t)s; break;
+        case op_div: d = s==-1 ? 0u-(uint32_t)d : (s ? d/s : 0); break; // INT32_MIN/-1 traps
+        case op_mod: d = s==-1 || s==0 ? 0 : d%s; break;
+        case op_scl: d = (int32_t)((uint32_t)d*(uint32_t)s)>>8; break;
+        case op_and: d &= s; break;
+        case op_shl: d = (uint32_t)d<<(regs & 0x0F); break;
+        case op_shr: d >>= (regs & 0x0F); break;
+        case op_min: if (s<d) d = s; break;
+        case op_max: if (s>d) d = s; break;
+        case op_sin: {
+          // parabolic approximation of a sine wave
+          int32_t t = d & 0x7F;
+          t = (t*(127-t))>>5;
+          d = (d & 0x80) ? 128-t : 128+t;
+          break;
+        }
+        case op_wheel: {
+          uint8_t h = d;
+          if (h<85) { r[0] = h*3; r[1] = 255-h*3; r[2] = 0; }
+          else if (h<170) { h -= 85; r[0] = 255-h*3; r[1] = 0; r[2] = h*3; }
+          else { h -= 170; r[0] = 0; r[1] = h*3; r[2] = 255-h*3; }
+          break;
+        }
+        case op_dim: {
+          int32_t f = d;
+          for (uint8_t c=0; c<3; c++) r[c] = (int32_t)((uint32_t)r[c]*(uint32_t)f)>>8;
+          break;
+        }
+      }
+    }
+    // clamp and output
+    for (uint8_t c=0; c<3; c++) {
+      if (r[c]<0) r[c] = 0;
+      else if (r[c]>255) r[c] = 255;
+    }
+    aLeds.setColorXY(x, y, r[0], r[1], r[2]);
+    if (++x>=ledsPerRow) { x = 0; y++; }
+  }
+}
+
+
+uint32_t p44_ws2812_vm::benchmark(p44_ws2812 &aLeds, uint16_t aRuns)
+{
+  uint32_t t = micros();
+  for (uint16_t n=0; n<aRuns; n++) run(aLeds, n);
+  t = micros()-t;
+  return t>0 ? (uint64_t)aRuns*aLeds.getNumLeds()*1000/t : 0;
+}
+
+
+
+// Pixel pipelines
+// ===============
+
+void p44_ws2812_contrast::color(uint16_t aLedIndex, p44_ws2812::RGBColor &aColor) const
+{
+  aColor.red = pwmTable[aColor.red>>3];
+  aColor.green = pwmTable[aColor.green>>3];
+  aColor.blue = pwmTable[aColor.blue>>3];
+}
+
+
+template<class P> void p44_ws2812::process(const P &aPipeline)
+{
+  RGBColor c;
+  if (!P::remapping) {
+    // straight pass over the buffer
+    for (uint16_t i=0; i<numLeds; i++) {
+      RGBPixel *pixP = &(pixelBufferP[i]);
+      c.red = pixP->red<<3;
+      c.green = pixP->green<<3;
+      c.blue = pixP->blue<<3;
+      aPipeline.apply(i, i, c);
+      storePixel(i, c.red, c.green, c.blue);
+    }
+  }
+  else {
+    // backwards in LED number order, so LEDs are read before they are modified
+    for (uint16_t n=numLeds; n>0; n--) {
+      uint16_t dst = ledIndexFromXY((n-1)%ledsPerRow, (n-1)/ledsPerRow);
+      if (dst>=numLeds) continue;
+      uint16_t src = aPipeline.map(n-1);
+      src = ledIndexFromXY(src%ledsPerRow, src/ledsPerRow);
+      if (src>=numLeds) continue;
+      RGBPixel *pixP = &(pixelBufferP[src]);
+      c.red = pixP->red<<3;
+      c.green = pixP->green<<3;
+      c.blue = pixP->blue<<3;
+      aPipeline.apply(src, dst, c);
+      storePixel(dst, c.red, c.green, c.blue);
+    }
+  }
+}
+
 
-  uint16_t numLeds; // number of LEDs
-  RGBPixel *pixelBufferP; // the pixel buffer
-  uint16_t ledsPerRow; // number of LEDs per row
-  bool xReversed; // even (0,2,4...) rows go backwards, or all if not alternating
-  bool alternating; // direction changes after every row
+template<class P> bool p44_ws2812::showProcessed(const P &aPipeline)
+{
+  // looking up LED numbers in run layouts is a search, too slow with IRQs blocked
+  if (P::remapping && layoutRunsP) return false;
+  p44_ws2812 *c = chainP ? chainP : this;
+  uint8_t enc[P44_WS2812_BYTES_PER_LED];
+  RGBColor col;
+  uint32_t irqState = c->blockIrqs();
+  for (uint16_t i=0; i<c->numLeds; i++) {
+    if (i>=firstLed && i<firstLed+numLeds) {
+      // within this chain or segment: apply the pipeline
+      uint16_t idx = i-firstLed;
+      if (P::remapping) {
+        uint16_t n = aPipeline.map(ledNumberFromIndex(idx));
+        idx = ledIndexFromXY(n%ledsPerRow, n/ledsPerRow);
+        if (idx>=numLeds) idx = i-firstLed;
+      }
+      RGBPixel *pixP = &(pixelBufferP[idx]);
+      col.red = pixP->red<<3;
+      col.green = pixP->green<<3;
+      col.blue = pixP->blue<<3;
+      aPipeline.apply(idx, i-firstLed, col);
+      c->encodeColor(i, col.red>>3, col.green>>3, col.blue>>3, enc);
+    }
+    else {
+      c->encodeLed(i, enc);
+    }
+    for (uint8_t j=0; j<P44_WS2812_BYTES_PER_LED; j++) SPI.transfer(enc[j]);
+  }
+  c->unblockIrqs(irqState);
+  // LEDs now differ from the buffer, next show() must transfer everything
+  c->invalidate();
+  return true;
+}
 
 
-public:
-  /// create driver for a WS2812 LED chain
-  /// @param aNumLeds number of LEDs in the chain
-  /// @param aLedsPerRow number of LEDs in a row (x size in a X/Y arrangement of the LEDs)
-  /// @param aXReversed X direction is reversed
-  /// @param aAlternating X direction is reversed in first row, normal in second, reversed in third etc..
-  p44_ws2812(uint16_t aNumLeds, uint16_t aLedsPerRow=0, bool aXReversed=false, bool aAlternating=false);
 
-  /// destructor
-  ~p44_ws2812();
+// Art-Net receiver
+// ================
 
-  /// begin using the driver
-  void begin();
+p44_ws2812_artnet::p44_ws2812_artnet()
+{
+  numOutputs = 0;
+  packets = 0;
+  dropped = 0;
+  invalid = 0;
+}
 
-  /// transfer RGB values to LED chain
-  /// @note this must be called to update the actual LEDs after modifying RGB values
-  /// with setColor() and/or setColorDimmed()
-  void show();
 
-  /// set color of one LED
-  /// @param aRed intensity of red component, 0..255
-  /// @param aGreen intensity of green component, 0..255
-  /// @param aBlue intensity of blue component, 0..255
-  void setColorXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue);
-  void setColor(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue);
+void p44_ws2812_artnet::begin(uint16_t aPort)
+{
+  udp.begin(aPort);
+}
 
-  /// set color of one LED, scaled by a visible brightness (non-linear) factor
-  /// @param aRed intensity of red component, 0..255
-  /// @param aGreen intensity of green component, 0..255
-  /// @param aBlue intensity of blue component, 0..255
-  /// @param aBrightness brightness, will be converted non-linear to PWM duty cycle for uniform brightness scale, 0..255
-  void setColorDimmedXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue, byte aBrightness);
-  void setColorDimmed(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aBrightness);
 
-  /// get current color of LED
-  /// @param aRed set to intensity of red component, 0..255
-  /// @param aGreen set to intensity of green component, 0..255
-  /// @param aBlue set to intensity of blue component, 0..255
-  /// @note for LEDs set with setColorDimmed(), this returns the scaled down RGB values,
-  ///   not the original r,g,b parameters. Note also that internal brightness resolution is 5 bits only.
-  void getColorXY(uint16_t aX, uint16_t aY, byte &aRed, byte &aGreen, byte &aBlue);
-  void getColor(uint16_t aLedNumber, byte &aRed, byte &aGreen, byte &aBlue);
+int p44_ws2812_artnet::addOutput(p44_ws2812 &aLeds, uint16_t aFirstUniverse)
+{
+  if (numOutputs>=maxOutputs) return -1;
+  Output &o = outputs[numOutputs];
+  o.ledsP = &aLeds;
+  o.firstUniverse = aFirstUniverse;
+  o.numUniverses = (aLeds.getNumLeds()+ledsPerUniverse-1)/ledsPerUniverse;
+  if (o.numUniverses>maxUniversesPerOutput) o.numUniverses = maxUniversesPerOutput;
+  o.receivedMask = 0;
+  memset(o.lastSequence, 0, sizeof(o.lastSequence));
+  return numOutputs++;
+}
 
-  /// @return number of LEDs
-  int getNumLeds();
 
-private:
+uint8_t p44_ws2812_artnet::process()
+{
+  uint8_t completed = 0;
+  // drain all pending packets in one go
+  while (udp.parsePacket()>0) {
+    // ArtDmx header: "Art-Net\0", OpCode 0x5000 (LE), ProtVer (BE), Sequence, Physical, SubUni, Net, Length (BE)
+    uint8_t hdr[18];
+    if (udp.read(hdr, sizeof(hdr))!=sizeof(hdr) || memcmp(hdr, "Art-Net", 8)!=0 || hdr[8]!=0x00 || hdr[9]!=0x50) {
+      invalid++;
+      udp.flush();
+      continue;
+    }
+    uint16_t universe = hdr[14] | ((hdr[15] & 0x7F)<<8);
+    uint16_t length = (hdr[16]<<8) | hdr[17];
+    // find output
+    Output *oP = NULL;
+    uint8_t u = 0;
+    uint8_t oi;
+    for (oi=0; oi<numOutputs; oi++) {
+      oP = &outputs[oi];
+      if (universe>=oP->firstUniverse && universe-oP->firstUniverse<oP->numUniverses) {
+        u = universe-oP->firstUniverse;
+        break;
+      }
+    }
+    if (oi>=numOutputs) {
+      invalid++; // not for us
+      udp.flush();
+      continue;
+    }
+    packets++;
+    // sequence check (0 means sequence numbers are not used)
+    uint8_t seq = hdr[12];
+    if (seq!=0 && oP->lastSequence[u]!=0) {
+      // sequence numbers wrap from 0xFF to 0x01, skipping 0
+      int16_t gap = seq-oP->lastSequence[u]-1;
+      if (gap<0) gap += 255;
+      if (gap<128) dropped += gap; // larger gaps are reordered packets
+    }
+    oP->lastSequence[u] = seq;
+    // read DMX data in chunks, directly into the pixel buffer
+    p44_ws2812::Update upd[16];
+    uint16_t ledNo = u*ledsPerUniverse;
+    uint16_t numLeds = length/3;
+    if (numLeds>ledsPerUniverse) numLeds = ledsPerUniverse;
+    while (numLeds>0) {
+      uint8_t n = numLeds>16 ? 16 : numLeds;
+      uint8_t rgb[16*3];
+      if (udp.read(rgb, n*3)!=n*3) break;
+      for (uint8_t i=0; i<n; i++) {
+        upd[i].ledNumber = ledNo+i;
+        upd[i].red = rgb[i*3];
+        upd[i].green = rgb[i*3+1];
+        upd[i].blue = rgb[i*3+2];
+      }
+      oP->ledsP->applyUpdates(upd, n);
+      ledNo += n;
+      numLeds -= n;
+    }
+    udp.flush();
+    // frame completeness
+    oP->receivedMask |= 1ul<<u;
+    uint32_t allMask = oP->numUniverses>=32 ? 0xFFFFFFFF : (1ul<<oP->numUniverses)-1;
+    if (oP->receivedMask==allMask) {
+      oP->receivedMask = 0;
+      completed |= 1<<oi;
+    }
+  }
+  return completed;
+}
 
-  uint16_t ledIndexFromXY(uint16_t aX, uint16_t aY);
 
 
-};
+// Cellular automaton
+// ==================
 
+p44_ws2812_life::p44_ws2812_life(uint16_t aWidth, uint16_t aHeight, bool aWrap)
+{
+  width = aWidth;
+  height = aHeight;
+  wrap = aWrap;
+  wordsPerRow = (width+31)/32;
+  cellsP = new uint32_t[2*wordsPerRow*height];
+  nextP = cellsP ? cellsP+wordsPerRow*height : NULL;
+  ageP = new uint8_t[width*height];
+  if (!ageP) {
+    delete[] cellsP;
+    cellsP = NULL;
+    nextP = NULL;
+  }
+  seed = 0x2545F491;
+  setRule(0x008, 0x00C); // B3/S23
+  clear();
+}
 
 
-// Implementation (would go to .cpp file once library is separated)
-// ================================================================
+p44_ws2812_life::~p44_ws2812_life()
+{
+  delete[] (cellsP<nextP ? cellsP : nextP); // generations are swapped, the lower one is the allocated buffer
+  delete[] ageP;
+}
 
-static const uint8_t pwmTable[32] = {0, 1, 1, 2, 3, 4, 6, 7, 9, 10, 13, 15, 18, 21, 24, 28, 33, 38, 44, 50, 58, 67, 77, 88, 101, 115, 132, 150, 172, 196, 224, 255};
 
-p44_ws2812::p44_ws2812(uint16_t aNumLeds, uint16_t aLedsPerRow, bool aXReversed, bool aAlternating)
+void p44_ws2812_life::setRule(uint16_t aBirthMask, uint16_t aSurviveMask)
 {
-  numLeds = aNumLeds;
-  if (aLedsPerRow==0)
-    ledsPerRow = aNumLeds; // single row
-  else
-    ledsPerRow = aLedsPerRow; // set row size
-  xReversed = aXReversed;
-  alternating = aAlternating;
-  // allocate the buffer
-  if((pixelBufferP = new RGBPixel[numLeds])!=NULL) {
-    memset(pixelBufferP, 0, sizeof(RGBPixel)*numLeds); // all LEDs off
+  birthMask = aBirthMask & 0x1FF;
+  surviveMask = aSurviveMask & 0x1FF;
+}
+
+
+bool p44_ws2812_life::setRule(const char *aRule)
+{
+  uint16_t b = 0, s = 0;
+  uint16_t *maskP = NULL;
+  for (; *aRule; aRule++) {
+    char c = *aRule;
+    if (c=='B' || c=='b') maskP = &b;
+    else if (c=='S' || c=='s') maskP = &s;
+    else if (c>='0' && c<='8' && maskP) *maskP |= 1<<(c-'0');
+    else if (c!='/') return false;
   }
+  setRule(b, s);
+  return true;
 }
 
-p44_ws2812::~p44_ws2812()
+
+void p44_ws2812_life::clear()
 {
-  // free the buffer
-  if (pixelBufferP) delete pixelBufferP;
+  if (!cellsP) return;
+  memset(cellsP, 0, wordsPerRow*height*sizeof(uint32_t));
+  memset(ageP, 0, width*height);
+  generation = 0;
+  fullRender = true;
 }
 
 
-int p44_ws2812::getNumLeds()
+void p44_ws2812_life::randomize(uint8_t aDensity)
 {
-  return numLeds;
+  clear();
+  for (uint16_t y=0; y<height; y++) {
+    for (uint16_t x=0; x<width; x++) {
+      // xorshift32
+      seed ^= seed<<13;
+      seed ^= seed>>17;
+      seed ^= seed<<5;
+      if ((seed&0xFF)<aDensity) setCell(x, y, true);
+    }
+  }
 }
 
 
-void p44_ws2812::begin()
+void p44_ws2812_life::setCell(uint16_t aX, uint16_t aY, bool aAlive)
 {
-  // begin using the driver
-  SPI.begin();
-  SPI.setClockDivider(SPI_CLOCK_DIV8); // System clock is 72MHz, we need 9MHz for SPI
-  SPI.setBitOrder(MSBFIRST); // MSB first for easier scope reading :-)
-  SPI.transfer(0); // make sure SPI line starts low (Note: SPI line remains at level of last sent bit, fortunately)
+  if (!cellsP || aX>=width || aY>=height) return;
+  uint32_t &w = cellsP[aY*wordsPerRow+aX/32];
+  if (aAlive) w |= 1ul<<(aX&31);
+  else w &= ~(1ul<<(aX&31));
 }
 
-void p44_ws2812::show()
+
+bool p44_ws2812_life::getCell(uint16_t aX, uint16_t aY)
 {
-  // Note: on the spark core, system IRQs might happen which exceed 50uS
-  // causing WS2812 chips to reset in midst of data stream.
-  // Thus, until we can send via DMA, we need to disable IRQs while sending
-  __disable_irq();
-  // transfer RGB values to LED chain
-  for (uint16_t i=0; i<numLeds; i++) {
-    RGBPixel *pixP = &(pixelBufferP[i]);
-    byte b;
-    // Order of PWM data for WS2812 LEDs is G-R-B
-    // - green
-    b = pwmTable[pixP->green];
-    for (byte j=0; j<8; j++) {
-      SPI.transfer(b & 0x80 ? 0x7E : 0x70);
-      b = b << 1;
-    }
-    // - red
-    b = pwmTable[pixP->red];
-    for (byte j=0; j<8; j++) {
-      SPI.transfer(b & 0x80 ? 0x7E : 0x70);
-      b = b << 1;
-    }
-    // - blue
-    b = pwmTable[pixP->blue];
-    for (byte j=0; j<8; j++) {
-      SPI.transfer(b & 0x80 ? 0x7E : 0x70);
-      b = b << 1;
-    }
+  if (!cellsP || aX>=width || aY>=height) return false;
+  return (cellsP[aY*wordsPerRow+aX/32]>>(aX&31)) & 1;
+}
+
+
+uint32_t p44_ws2812_life::getPopulation()
+{
+  uint32_t n = 0;
+  if (!cellsP) return 0;
+  for (uint32_t i=0; i<(uint32_t)wordsPerRow*height; i++) {
+    for (uint32_t w = cellsP[i]; w; w &= w-1) n++;
   }
-  __enable_irq();
+  return n;
 }
 
 
-uint16_t p44_ws2812::ledIndexFromXY(uint16_t aX, uint16_t aY)
+void p44_ws2812_life::rowWord(const uint32_t *aRowP, uint16_t aWord, uint32_t &aLeft, uint32_t &aCenter, uint32_t &aRight)
 {
-  uint16_t ledindex = aY*ledsPerRow;
-  bool reversed = xReversed;
-  if (alternating) {
-    if (aY & 0x1) reversed = !reversed;
+  if (!aRowP) {
+    aLeft = 0; aCenter = 0; aRight = 0;
+    return;
   }
-  if (reversed) {
-    ledindex += (ledsPerRow-1-aX);
+  // bit i is cell aWord*32+i, so the left neighbours are shifted up, the right neighbours down
+  aCenter = aRowP[aWord];
+  uint32_t prev = aWord>0 ? aRowP[aWord-1]>>31 : 0;
+  uint32_t next = aWord+1<wordsPerRow ? aRowP[aWord+1]<<31 : 0;
+  if (wrap) {
+    uint16_t lastBit = (width-1)&31;
+    if (aWord==0) prev = (aRowP[wordsPerRow-1]>>lastBit) & 1;
+    if (aWord+1==wordsPerRow) next = (aRowP[0]&1)<<lastBit;
   }
-  else {
-    ledindex += aX;
+  aLeft = (aCenter<<1) | prev;
+  aRight = (aCenter>>1) | next;
+}
+
+
+void p44_ws2812_life::step()
+{
+  if (!cellsP) return;
+  // bits beyond the width in the last word of a row must stay zero
+  uint32_t lastMask = (width&31) ? (1ul<<(width&31))-1 : 0xFFFFFFFF;
+  for (uint16_t y=0; y<height; y++) {
+    const uint32_t *upP = y>0 ? cellsP+(y-1)*wordsPerRow : (wrap ? cellsP+(height-1)*wordsPerRow : NULL);
+    const uint32_t *rowP = cellsP+y*wordsPerRow;
+    const uint32_t *downP = y+1<height ? rowP+wordsPerRow : (wrap ? cellsP : NULL);
+    for (uint16_t i=0; i<wordsPerRow; i++) {
+      uint32_t n1, n2, n3, n4, alive, n5, n6, n7, n8;
+      rowWord(upP, i, n1, n2, n3);
+      rowWord(rowP, i, n4, alive, n5);
+      rowWord(downP, i, n6, n7, n8);
+      // bit-sliced sum of the 8 neighbours into s3..s0, with full and half adders
+      uint32_t sa = n1^n2^n3, ca = (n1&n2)|(n3&(n1^n2));
+      uint32_t sb = n4^n5^n6, cb = (n4&n5)|(n6&(n4^n5));
+      uint32_t sc = n7^n8, cc = n7&n8;
+      uint32_t s0 = sa^sb^sc, cd = (sa&sb)|(sc&(sa^sb)); // ones
+      uint32_t t = ca^cb^cc, ce = (ca&cb)|(cc&(ca^cb)); // twos
+      uint32_t s1 = t^cd, cf = t&cd;
+      uint32_t s2 = ce^cf, s3 = ce&cf; // fours, eights
+      // apply rule: or together the cells having each neighbour count the rule cares about
+      uint32_t res = 0;
+      for (uint8_t n=0; n<=8; n++) {
+        uint32_t sel = ((birthMask>>n)&1 ? ~alive : 0) | ((surviveMask>>n)&1 ? alive : 0);
+        if (!sel) continue;
+        res |= sel & (n&1 ? s0 : ~s0) & (n&2 ? s1 : ~s1) & (n&4 ? s2 : ~s2) & (n&8 ? s3 : ~s3);
+      }
+      if (i+1==wordsPerRow) res &= lastMask;
+      nextP[y*wordsPerRow+i] = res;
+    }
   }
-  return ledindex;
+  uint32_t *t = cellsP;
+  cellsP = nextP;
+  nextP = t;
+  generation++;
 }
 
 
-void p44_ws2812::setColor(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue)
+void p44_ws2812_life::render(p44_ws2812 &aLeds, const p44_ws2812::RGBColor *aPalette, uint8_t aNumColors)
 {
-  int y = aLedNumber / ledsPerRow;
-  int x = aLedNumber % ledsPerRow;
-  setColorXY(x, y, aRed, aGreen, aBlue);
+  if (!cellsP || aNumColors==0) return;
+  uint8_t *agP = ageP;
+  for (uint16_t y=0; y<height; y++) {
+    for (uint16_t i=0; i<wordsPerRow; i++) {
+      uint32_t w = cellsP[y*wordsPerRow+i];
+      uint16_t x = i*32;
+      uint16_t n = width-x<32 ? width-x : 32;
+      for (uint16_t b=0; b<n; b++, x++, agP++, w>>=1) {
+        if (w&1) {
+          if (*agP<255) (*agP)++;
+          const p44_ws2812::RGBColor &c = aPalette[*agP<=aNumColors ? *agP-1 : aNumColors-1];
+          aLeds.setColorXY(x, y, c.red, c.green, c.blue);
+        }
+        else if (*agP || fullRender) {
+          // just died (or initial render)
+          *agP = 0;
+          aLeds.setColorXY(x, y, 0, 0, 0);
+        }
+      }
+    }
+  }
+  fullRender = false;
 }
 
 
-void p44_ws2812::setColorXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue)
+
+// Sparkle engine
+// ==============
+
+p44_ws2812_sparkle::p44_ws2812_sparkle()
 {
-  uint16_t ledindex = ledIndexFromXY(aX,aY);
-  if (ledindex>=numLeds) return;
-  RGBPixel *pixP = &(pixelBufferP[ledindex]);
-  // linear brightness is stored with 5bit precision only
-  pixP->red = aRed>>3;
-  pixP->green = aGreen>>3;
-  pixP->blue = aBlue>>3;
+  numActive = 0;
+  background.red = 0; background.green = 0; background.blue = 0;
+  paletteP = NULL;
+  numColors = 0;
+  spawnAccumulator = 0;
+  seed = 0x9E3779B9;
+  setRate(64);
 }
 
 
-void p44_ws2812::setColorDimmed(uint16_t aLedNumber, byte aRed, byte aGreen, byte aBlue, byte aBrightness)
+void p44_ws2812_sparkle::setRate(uint16_t aPerFrame, uint16_t aMinSpeed, uint16_t aMaxSpeed)
 {
-  int y = aLedNumber / ledsPerRow;
-  int x = aLedNumber % ledsPerRow;
-  setColorDimmedXY(x, y, aRed, aGreen, aBlue, aBrightness);
+  spawnRate = aPerFrame;
+  minSpeed = aMinSpeed>0 ? aMinSpeed : 1;
+  maxSpeed = aMaxSpeed>minSpeed ? aMaxSpeed : minSpeed;
 }
 
 
-void p44_ws2812::setColorDimmedXY(uint16_t aX, uint16_t aY, byte aRed, byte aGreen, byte aBlue, byte aBrightness)
+void p44_ws2812_sparkle::setColors(const p44_ws2812::RGBColor *aPalette, uint8_t aNumColors)
 {
-  setColorXY(aX, aY, (aRed*aBrightness)>>8, (aGreen*aBrightness)>>8, (aBlue*aBrightness)>>8);
+  paletteP = aNumColors>0 ? aPalette : NULL;
+  numColors = aNumColors;
 }
 
 
-void p44_ws2812::getColor(uint16_t aLedNumber, byte &aRed, byte &aGreen, byte &aBlue)
+void p44_ws2812_sparkle::setBackground(byte aRed, byte aGreen, byte aBlue)
 {
-  int y = aLedNumber / ledsPerRow;
-  int x = aLedNumber % ledsPerRow;
-  getColorXY(x, y, aRed, aGreen, aBlue);
+  background.red = aRed;
+  background.green = aGreen;
+  background.blue = aBlue;
 }
 
 
-void p44_ws2812::getColorXY(uint16_t aX, uint16_t aY, byte &aRed, byte &aGreen, byte &aBlue)
+bool p44_ws2812_sparkle::spawn(uint16_t aLedNumber, const p44_ws2812::RGBColor &aColor, uint16_t aSpeed)
 {
-  uint16_t ledindex = ledIndexFromXY(aX,aY);
-  if (ledindex>=numLeds) return;
-  RGBPixel *pixP = &(pixelBufferP[ledindex]);
-  // linear brightness is stored with 5bit precision only
-  aRed = pixP->red<<3;
-  aGreen = pixP->green<<3;
-  aBlue = pixP->blue<<3;
+  if (numActive>=maxTwinkles) return false;
+  for (uint8_t i=0; i<numActive; i++) {
+    if (twinkles[i].ledNumber==aLedNumber) return false;
+  }
+  Twinkle &tw = twinkles[numActive++];
+  tw.ledNumber = aLedNumber;
+  tw.phase = 0;
+  tw.speed = aSpeed>0 ? aSpeed : 1;
+  tw.color = aColor;
+  return true;
+}
+
+
+void p44_ws2812_sparkle::update(p44_ws2812 &aLeds)
+{
+  if (aLeds.getNumLeds()==0) return; // nothing to sparkle on
+  // spawn new twinkles
+  spawnAccumulator += spawnRate;
+  while (spawnAccumulator>=256) {
+    spawnAccumulator -= 256;
+    // xorshift32
+    seed ^= seed<<13;
+    seed ^= seed>>17;
+    seed ^= seed<<5;
+    p44_ws2812::RGBColor c = { 255, 255, 255 };
+    if (paletteP) c = paletteP[(seed>>24)%numColors];
+    spawn((seed&0xFFFF)%aLeds.getNumLeds(), c, minSpeed+((seed>>16)&0xFF)*(maxSpeed-minSpeed)/255);
+  }
+  // advance active twinkles
+  uint8_t i = 0;
+  while (i<numActive) {
+    Twinkle &tw = twinkles[i];
+    if ((uint32_t)tw.phase+tw.speed>0xFFFF) {
+      // ended: restore background, replace by last active twinkle
+      aLeds.setColor(tw.ledNumber, background.red, background.green, background.blue);
+      tw = twinkles[--numActive];
+      continue;
+    }
+    tw.phase += tw.speed;
+    // triangle fade in and out, blended over the background
+    uint16_t level = (tw.phase<0x8000 ? tw.phase : 0xFFFF-tw.phase)>>7; // 0..255
+    aLeds.setColor(
+      tw.ledNumber,
+      background.red+(((int16_t)tw.color.red-background.red)*level>>8),
+      background.green+(((int16_t)tw.color.green-background.green)*level>>8),
+      background.blue+(((int16_t)tw.color.blue-background.blue)*level>>8)
+    );
+    i++;
+  }
+}
+
+
+void p44_ws2812_sparkle::clear(p44_ws2812 &aLeds)
+{
+  for (uint8_t i=0; i<numActive; i++) {
+    aLeds.setColor(twinkles[i].ledNumber, background.red, background.green, background.blue);
+  }
+  numActive = 0;
 }
 
 
 
+// Preview
+// =======
+
+p44_ws2812_preview::p44_ws2812_preview(Print &aOutput, uint32_t aFrameBudgetMicros, bool aPPM) :
+  output(aOutput)
+{
+  ppm = aPPM;
+  frameBudget = aFrameBudgetMicros;
+  renderStart = micros();
+}
+
+
+void p44_ws2812_preview::startFrame()
+{
+  renderStart = micros();
+}
+
+
+void p44_ws2812_preview::show(p44_ws2812 &aLeds)
+{
+  uint32_t t = micros();
+  uint32_t renderMicros = t-renderStart;
+  aLeds.show();
+  uint32_t showMicros = micros()-t;
+  // transfer time for the entire chain at 9MHz SPI clock (segments show the entire chain as well)
+  uint32_t busMicros = (uint32_t)aLeds.getChainNumLeds()*P44_WS2812_BYTES_PER_LED*8/9;
+  uint16_t w = aLeds.getLedsPerRow();
+  uint16_t h = (aLeds.getNumLeds()+w-1)/w;
+  p44_ws2812::RGBColor c;
+  if (ppm) {
+    output.print("P6\n");
+    output.print(w);
+    output.print(" ");
+    output.print(h);
+    output.print("\n255\n");
+    for (uint16_t y=0; y<h; y++) {
+      for (uint16_t x=0; x<w; x++) {
+        if (!aLeds.getOutputColorXY(x, y, c)) { c.red = 0; c.green = 0; c.blue = 0; }
+        output.write(c.red);
+        output.write(c.green);
+        output.write(c.blue);
+      }
+    }
+    return; // no text overlay in images
+  }
+  output.print("\x1b[H"); // home, draw over previous frame
+  for (uint16_t y=0; y<h; y++) {
+    for (uint16_t x=0; x<w; x++) {
+      if (aLeds.getOutputColorXY(x, y, c)) {
+        output.print("\x1b[48;2;");
+        output.print(c.red);
+        output.print(";");
+        output.print(c.green);
+        output.print(";");
+        output.print(c.blue);
+        output.print("m  ");
+      }
+      else {
+        output.print("\x1b[0m  ");
+      }
+    }
+    output.print("\x1b[0m\r\n");
+  }
+  // timing overlay, red when exceeding the budget
+  uint32_t total = renderMicros+showMicros;
+  output.print(total>frameBudget ? "\x1b[31m" : "\x1b[32m");
+  output.print("render ");
+  output.print(renderMicros);
+  output.print("uS, show ");
+  output.print(showMicros);
+  output.print("uS (bus ");
+  output.print(busMicros);
+  output.print("uS), total ");
+  output.print(total);
+  output.print("/");
+  output.print(frameBudget);
+  output.print("uS\x1b[0m\x1b[K\r\n");
+}
+
+
 // Main program, example showing a color cycle
 // ===========================================
 
@@ -262,8 +3568,398 @@ byte cnt = 0;
 
 p44_ws2812 leds(240); // for 4m strip with 240 LEDs
 
+
+#ifdef P44_WS2812_BENCHMARK
+
+// Benchmarks, define P44_WS2812_BENCHMARK to have them printed to Serial at startup
+
+// expensive effect, rendered progressively a few LEDs at a time
+class SlowWheelRenderer : public p44_ws2812_renderer {
+  uint16_t next; // next LED to render
+  uint8_t offset; // color cycle position
+public:
+  SlowWheelRenderer() : next(0), offset(0) {};
+  virtual void startFrame(p44_ws2812 &aLeds) { next = 0; offset++; };
+  virtual bool renderChunk(p44_ws2812 &aLeds)
+  {
+    byte r,g,b;
+    for (uint8_t i=0; i<8 && next<aLeds.getNumLeds(); i++, next++) {
+      delayMicroseconds(50); // simulate expensive calculation
+      wheel(((next*256/aLeds.getNumLeds())+offset) & 255, r, g, b);
+      aLeds.setColor(next, r, g, b);
+    }
+    return next>=aLeds.getNumLeds();
+  };
+};
+
+// color cycle as in loop(), as effect bytecode
+static const uint8_t wheelProgram[] = {
+  p44_ws2812_vm::op_idx, 0x30, // r3 = index
+  p44_ws2812_vm::op_shl, 0x38, // r3 <<= 8
+  p44_ws2812_vm::op_num, 0x40, // r4 = numLeds
+  p44_ws2812_vm::op_div, 0x34, // r3 /= r4
+  p44_ws2812_vm::op_time, 0x40, // r4 = time
+  p44_ws2812_vm::op_add, 0x34, // r3 += r4
+  p44_ws2812_vm::op_wheel, 0x30, // r0..r2 = wheel(r3)
+  p44_ws2812_vm::op_ldi, 0x50, 128, 0, // r5 = 128
+  p44_ws2812_vm::op_dim, 0x50, // r0..r2 dimmed by r5
+  p44_ws2812_vm::op_end
+};
+
+
+void printBenchmark(const char *aName, uint32_t aValue, const char *aUnit)
+{
+  Serial.print(aName);
+  Serial.print(": ");
+  Serial.print(aValue);
+  Serial.println(aUnit);
+}
+
+
+#ifdef STM32F10X_MD
+
+// Interrupt latency during show(): a timer compare interrupt is armed to fire at a random point within
+// the transfer, and the timer count at ISR entry tells how long it was delayed.
+
+// Timer used to inject the synthetic interrupts. The firmware defines the IRQ handler itself and calls
+// the handler installed in its hook pointer.
+#ifndef P44_WS2812_LATENCY_TIM
+#define P44_WS2812_LATENCY_TIM TIM4
+#define P44_WS2812_LATENCY_IRQn TIM4_IRQn
+#define P44_WS2812_LATENCY_HOOK Wiring_TIM4_Interrupt_Handler
+#define P44_WS2812_LATENCY_CLKEN RCC_APB1ENR_TIM4EN
+#endif
+
+extern void (*P44_WS2812_LATENCY_HOOK)(void);
+
+static const uint8_t latencyBuckets = 8; // <2,<4,<8...<128,>=128 uS
+static volatile uint16_t latencyDue; // timer count the interrupt is due at
+static volatile uint16_t latency; // measured latency in uS
+static volatile bool latencyFired;
+
+static void latencyHandler()
+{
+  uint16_t now = P44_WS2812_LATENCY_TIM->CNT;
+  P44_WS2812_LATENCY_TIM->DIER = 0;
+  P44_WS2812_LATENCY_TIM->SR = ~TIM_SR_CC1IF;
+  latency = now-latencyDue;
+  latencyFired = true;
+}
+
+
+void benchmarkIrqLatency(p44_ws2812 &aLeds, const char *aMode)
+{
+  const uint8_t samples = 50;
+  uint16_t buckets[latencyBuckets];
+  memset(buckets, 0, sizeof(buckets));
+  uint32_t sum = 0;
+  uint16_t maxLatency = 0;
+  uint16_t showMicros = (uint32_t)aLeds.getNumLeds()*P44_WS2812_BYTES_PER_LED*8/9; // at 9MHz SPI clock
+  uint32_t seed = 0x12345678;
+  for (uint8_t i=0; i<samples; i++) {
+    seed ^= seed<<13;
+    seed ^= seed>>17;
+    seed ^= seed<<5;
+    aLeds.invalidate();
+    latencyFired = false;
+    latencyDue = P44_WS2812_LATENCY_TIM->CNT+20+seed%showMicros; // 20uS to get into show()
+    P44_WS2812_LATENCY_TIM->CCR1 = latencyDue;
+    P44_WS2812_LATENCY_TIM->SR = ~TIM_SR_CC1IF;
+    P44_WS2812_LATENCY_TIM->DIER = TIM_DIER_CC1IE;
+    aLeds.show();
+    while (!latencyFired) ; // in case show() ended before the interrupt was due
+    uint8_t b = 0;
+    for (uint16_t l = latency>>1; l>0 && b<latencyBuckets-1; l >>= 1) b++;
+    buckets[b]++;
+    sum += latency;
+    if (latency>maxLatency) maxLatency = latency;
+    delayMicroseconds(P44_WS2812_RESET_MICROS);
+  }
+  Serial.print(aMode);
+  Serial.print("\t");
+  Serial.print(aLeds.getNumLeds());
+  Serial.print("\t");
+  Serial.print(sum/samples);
+  Serial.print("\t");
+  Serial.print(maxLatency);
+  for (uint8_t b=0; b<latencyBuckets; b++) {
+    Serial.print("\t");
+    Serial.print(buckets[b]);
+  }
+  Serial.println();
+}
+
+
+void runIrqLatencyBenchmarks()
+{
+  // timer counting microseconds
+  RCC->APB1ENR |= P44_WS2812_LATENCY_CLKEN;
+  P44_WS2812_LATENCY_TIM->CR1 = 0;
+  P44_WS2812_LATENCY_TIM->PSC = 71; // 72MHz timer clock
+  P44_WS2812_LATENCY_TIM->ARR = 0xFFFF;
+  P44_WS2812_LATENCY_TIM->DIER = 0;
+  P44_WS2812_LATENCY_TIM->CR1 = TIM_CR1_CEN;
+  void (*prevHandler)(void) = P44_WS2812_LATENCY_HOOK;
+  P44_WS2812_LATENCY_HOOK = latencyHandler;
+  NVIC_SetPriority(P44_WS2812_LATENCY_IRQn, 1);
+  NVIC_EnableIRQ(P44_WS2812_LATENCY_IRQn);
+  Serial.println("IRQ latency during show() [uS]");
+  Serial.println("mode\tLEDs\tmean\tmax\t<2\t<4\t<8\t<16\t<32\t<64\t<128\t>=128");
+  const uint16_t lengths[] = { 60, 240, 1000 };
+  for (uint8_t i=0; i<3; i++) {
+    p44_ws2812 latLeds(lengths[i]);
+    if (latLeds.getNumLeds()==0) continue; // not enough memory
+    latLeds.begin();
+    benchmarkIrqLatency(latLeds, "disable_irq");
+    latLeds.setIrqPriorityThreshold(2); // the timer IRQ (priority 1) is not blocked
+    benchmarkIrqLatency(latLeds, "BASEPRI");
+    latLeds.setIrqPriorityThreshold(0);
+    if (latLeds.enableEncodeBuffer()) benchmarkIrqLatency(latLeds, "encoded");
+  }
+  // there are no IRQ or DMA driven transfer modes (yet) to compare with
+  NVIC_DisableIRQ(P44_WS2812_LATENCY_IRQn);
+  P44_WS2812_LATENCY_TIM->CR1 = 0;
+  P44_WS2812_LATENCY_HOOK = prevHandler;
+}
+
+#endif // STM32F10X_MD
+
+
+void runBenchmarks()
+{
+  const uint16_t runs = 20;
+  uint32_t t;
+  byte r,g,b;
+  // native color cycle
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) {
+    for(int i=0; i<leds.getNumLeds(); i++) {
+      wheel(((i * 256 / leds.getNumLeds()) + n) & 255, r, g, b);
+      leds.setColorDimmed(i, r, g, b, 128);
+    }
+  }
+  t = micros()-t;
+  printBenchmark("native color cycle", t>0 ? (uint32_t)runs*leds.getNumLeds()*1000/t : 0, " LEDs/ms");
+  // same with palette interpolation
+  p44_ws2812::RGBColor wheelPalette[16];
+  for (uint8_t i=0; i<16; i++) wheel(i*16, wheelPalette[i].red, wheelPalette[i].green, wheelPalette[i].blue);
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) {
+    leds.fillPalette(wheelPalette, n<<8, 65536/leds.getNumLeds());
+  }
+  t = micros()-t;
+  printBenchmark("palette color cycle", t>0 ? (uint32_t)runs*leds.getNumLeds()*1000/t : 0, " LEDs/ms");
+  // same as bytecode
+  p44_ws2812_vm vm;
+  vm.load(wheelProgram, sizeof(wheelProgram));
+  printBenchmark("bytecode color cycle", vm.benchmark(leds, runs), " LEDs/ms");
+  // pixel pipeline, separate passes vs. fused
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) {
+    leds.process(p44_ws2812_fade(200));
+    leds.process(p44_ws2812_mirror(leds.getNumLeds()));
+    leds.process(p44_ws2812_contrast());
+  }
+  t = micros()-t;
+  printBenchmark("fade, mirror, contrast in separate passes", t/runs, " uS");
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) {
+    leds.process(p44_ws2812_fade(200) | p44_ws2812_mirror(leds.getNumLeds()) | p44_ws2812_contrast());
+  }
+  t = micros()-t;
+  printBenchmark("fade, mirror, contrast fused", t/runs, " uS");
+  // positional stage before a remapping one: fused must match separate passes
+  p44_ws2812 pipeA(16), pipeB(16), pipeOther(16);
+  for (uint16_t i=0; i<16; i++) {
+    pipeA.setColor(i, i*16, 255-i*16, 0);
+    pipeB.setColor(i, i*16, 255-i*16, 0);
+    pipeOther.setColor(i, 0, i*16, 255-i*16);
+  }
+  pipeA.process(p44_ws2812_blend(pipeOther, 128) | p44_ws2812_mirror(16));
+  pipeB.process(p44_ws2812_blend(pipeOther, 128));
+  pipeB.process(p44_ws2812_mirror(16));
+  printBenchmark("blend, mirror fused matches separate passes", pipeA.getFingerprint(false)==pipeB.getFingerprint(false), "");
+  // encoding cost with and without calibration (setCalibration() re-encodes the entire chain)
+  p44_ws2812 encLeds(leds.getNumLeds());
+  uint8_t *calib = new uint8_t[3*encLeds.getNumLeds()];
+  if (calib && encLeds.enableEncodeBuffer()) {
+    memset(calib, 0xE0, 3*encLeds.getNumLeds());
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) encLeds.setCalibration(NULL);
+    t = micros()-t;
+    printBenchmark("encode", t*1000/((uint32_t)runs*encLeds.getNumLeds()), " nS/LED");
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) encLeds.setCalibration(calib);
+    t = micros()-t;
+    printBenchmark("encode with calibration", t*1000/((uint32_t)runs*encLeds.getNumLeds()), " nS/LED");
+    encLeds.setCalibration(NULL);
+  }
+  delete[] calib;
+  // blur
+  p44_ws2812 *blurLedsP = new p44_ws2812(1024, 32, false, true);
+  if (blurLedsP) {
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) blurLedsP->blur(2, 3);
+    t = micros()-t;
+    printBenchmark("32x32 gaussian blur", t/runs, " uS");
+    delete blurLedsP;
+  }
+  blurLedsP = new p44_ws2812(1000);
+  if (blurLedsP) {
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) blurLedsP->blur(2, 3);
+    t = micros()-t;
+    printBenchmark("1000 LED strip gaussian blur", t/runs, " uS");
+    delete blurLedsP;
+  }
+  // cellular automaton
+  p44_ws2812_life *lifeP = new p44_ws2812_life(64, 64);
+  if (lifeP && lifeP->isValid()) {
+    lifeP->randomize();
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) lifeP->step();
+    t = micros()-t;
+    printBenchmark("64x64 life", t>0 ? (uint32_t)runs*1000000/t : 0, " generations/s");
+  }
+  delete lifeP;
+  // sparkle engine vs. full buffer twinkle pass
+  p44_ws2812_sparkle sparkle;
+  sparkle.setRate(512);
+  for (uint16_t n=0; n<100; n++) sparkle.update(leds); // reach steady state
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) sparkle.update(leds);
+  t = micros()-t;
+  printBenchmark("sparkle engine frame", t/runs, " uS");
+  printBenchmark("active twinkles", sparkle.getNumActive(), "");
+  sparkle.clear(leds);
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) {
+    for (uint16_t i=0; i<leds.getNumLeds(); i++) {
+      leds.getColor(i, r, g, b);
+      leds.setColorDimmed(i, r, g, b, 240);
+    }
+  }
+  t = micros()-t;
+  printBenchmark("full buffer twinkle frame", t/runs, " uS");
+  // RLE sprites: a ring with a color gradient, transparent outside
+  p44_ws2812::RGBColor spritePalette[8];
+  for (uint8_t i=0; i<8; i++) wheel(i*32, spritePalette[i].red, spritePalette[i].green, spritePalette[i].blue);
+  p44_ws2812::RGBColor transparent = { 0, 0, 0 };
+  p44_ws2812::RGBColor *spritePixels = new p44_ws2812::RGBColor[16*16];
+  uint8_t *spriteP = new uint8_t[3*16*16+64];
+  p44_ws2812 *spriteLedsP = new p44_ws2812(1024, 32, false, true);
+  if (spritePixels && spriteP && spriteLedsP) {
+    for (uint8_t y=0; y<16; y++) {
+      for (uint8_t x=0; x<16; x++) {
+        int16_t d = (x-8)*(x-8)+(y-8)*(y-8);
+        spritePixels[y*16+x] = d>=16 && d<64 ? spritePalette[(x+y)/4] : transparent;
+      }
+    }
+    size_t rgbSize = p44_ws2812::compressSprite(spriteP, 3*16*16+64, spritePixels, 16, 16, &transparent, NULL, 0);
+    printBenchmark("16x16 RGB sprite compressed to", rgbSize*100/(3*16*16), "%");
+    size_t palSize = p44_ws2812::compressSprite(spriteP, 3*16*16+64, spritePixels, 16, 16, &transparent, spritePalette, 8);
+    printBenchmark("16x16 palette sprite compressed to", palSize*100/(3*16*16), "%");
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) spriteLedsP->blit(spriteP, n%24, 8);
+    t = micros()-t;
+    printBenchmark("sprite blit", t>0 ? (uint32_t)runs*16*16*1000/t : 0, " pixels/ms");
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) {
+      for (uint8_t y=0; y<16; y++) {
+        for (uint8_t x=0; x<16; x++) {
+          const p44_ws2812::RGBColor &c = spritePixels[y*16+x];
+          if (!sameColor(c, transparent)) spriteLedsP->setColorXY(n%24+x, 8+y, c.red, c.green, c.blue);
+        }
+      }
+    }
+    t = micros()-t;
+    printBenchmark("uncompressed setColorXY() blit", t>0 ? (uint32_t)runs*16*16*1000/t : 0, " pixels/ms");
+  }
+  delete spriteLedsP;
+  delete[] spriteP;
+  delete[] spritePixels;
+  // progressive rendering: output keeps 60fps while rendering frames taking several frame periods
+  p44_ws2812 progLeds(leds.getNumLeds());
+  if (progLeds.enableDoubleBuffer()) {
+    SlowWheelRenderer slowWheel;
+    uint16_t shown = 0, committed = 0;
+    uint32_t maxLoop = 0;
+    t = micros();
+    while (committed<3) {
+      uint32_t frameStart = micros();
+      if (progLeds.renderProgressive(slowWheel, 8000)) committed++;
+      progLeds.show();
+      shown++;
+      uint32_t lt = micros()-frameStart;
+      if (lt>maxLoop) maxLoop = lt;
+      while (micros()-frameStart<16667) ; // 60fps
+    }
+    t = micros()-t;
+    printBenchmark("progressive frame render time", t/committed, " uS");
+    printBenchmark("frames shown per rendered frame", shown/committed, "");
+    printBenchmark("max loop iteration", maxLoop, " uS");
+  }
+  // thermal model update cost per frame, 32 regions of 32 LEDs
+  p44_ws2812 *thermLedsP = new p44_ws2812(1024, 32);
+  if (thermLedsP) {
+    thermLedsP->fill(0, 1024, 255, 255, 255);
+    t = micros();
+    for (uint16_t n=0; n<runs; n++) thermLedsP->show();
+    uint32_t tPlain = micros()-t;
+    if (thermLedsP->enableThermalModel(5, 128, 4)) {
+      for (uint16_t n=0; n<200; n++) thermLedsP->show(); // settle
+      t = micros();
+      for (uint16_t n=0; n<runs; n++) thermLedsP->show();
+      t = micros()-t;
+      printBenchmark("thermal model update per frame", t>tPlain ? (t-tPlain)/runs : 0, " uS");
+      printBenchmark("derating of full white region", thermLedsP->getDerating(0), "/255");
+    }
+    delete thermLedsP;
+  }
+  // startup from a precompiled configuration
+  uint16_t half = leds.getNumLeds()/2;
+  p44_ws2812::LayoutRun layoutRuns[2] = { { 0, 1, half }, { (uint16_t)(leds.getNumLeds()-1), -1, (uint16_t)(leds.getNumLeds()-half) } };
+  uint32_t cfg[(sizeof(p44_ws2812::ConfigHeader)+sizeof(layoutRuns))/4+1];
+  size_t cfgSize = p44_ws2812::buildConfig((uint8_t *)cfg, sizeof(cfg), leds.getNumLeds(), 0, false, false, layoutRuns, 2, NULL, 0);
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) leds.useConfig((const uint8_t *)cfg, cfgSize);
+  t = micros()-t;
+  printBenchmark("useConfig", t*1000/runs, " nS");
+  leds.setLayout(NULL, 0);
+  // frame fingerprint
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) leds.getFingerprint(false);
+  t = micros()-t;
+  printBenchmark("fingerprint in software", t/runs, " uS");
+  t = micros();
+  for (uint16_t n=0; n<runs; n++) leds.getFingerprint(true);
+  t = micros()-t;
+  printBenchmark("fingerprint with CRC unit", t/runs, " uS");
+  // IRQ timing
+  printBenchmark("max IRQ duration during show()", p44_ws2812::getMaxIrqNanos(), " nS");
+  #ifdef STM32F10X_MD
+  runIrqLatencyBenchmarks();
+  #endif
+}
+
+#endif // P44_WS2812_BENCHMARK
+
+
+#ifdef P44_WS2812_PREVIEW
+// define P44_WS2812_PREVIEW to see the LEDs on a terminal connected to Serial
+p44_ws2812_preview preview(Serial);
+#endif
+
+
 void setup() {
   leds.begin();
+  #ifdef P44_WS2812_PREVIEW
+  Serial.begin(9600);
+  #endif
+  #ifdef P44_WS2812_BENCHMARK
+  Serial.begin(9600);
+  runBenchmarks();
+  #endif
 }
 
 
@@ -271,13 +3967,21 @@ void loop() {
 
   byte r,g,b;
 
+  #ifdef P44_WS2812_PREVIEW
+  preview.startFrame();
+  #endif
+
   // create color cycle
   for(int i=0; i<leds.getNumLeds(); i++) {
     wheel(((i * 256 / leds.getNumLeds()) + cnt) & 255, r, g, b);
     leds.setColorDimmed(i, r, g, b, 128);
   }
 
+  #ifdef P44_WS2812_PREVIEW
+  preview.show(leds);
+  #else
   leds.show();
+  #endif
 
   cnt++;
   delay(1); // latch & reset needs 50 microseconds pause, at least.